@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "tree_sitter/api.h"
+
+#define ARENA_CHUNK_SIZE (256 * 1024)
+// larger requests get a chunk of their own so they do not waste the tail of a shared one
+#define ARENA_MAX_SHARED_ALLOC (ARENA_CHUNK_SIZE / 4)
+#define ARENA_MAX_SPARE 4
+#define ARENA_ALIGN 16
+
+struct ArenaChunk {
+  ArenaChunk *next;
+  size_t size;
+  size_t used;
+  int64_t live;
+  _Alignas(ARENA_ALIGN) char data[];
+};
+
+// Precedes every pointer handed to tree-sitter, heap ones included, so free
+// and realloc can tell where the memory came from.
+typedef struct {
+  _Alignas(ARENA_ALIGN) ArenaChunk *chunk;
+  size_t size;
+} ArenaHeader;
+
+static __thread Arena *t_arena;
+
+static size_t
+align_up(size_t n)
+{
+  return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static ArenaChunk *
+chunk_new(Arena *arena, size_t size)
+{
+  ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + size);
+  if (chunk == NULL) {
+    abort();
+  }
+  arena->heap_allocs++;
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = 0;
+  chunk->live = 0;
+
+  return chunk;
+}
+
+static void
+chunk_release(Arena *arena, ArenaChunk *chunk)
+{
+  if (chunk->size == ARENA_CHUNK_SIZE && arena->spare_count < ARENA_MAX_SPARE) {
+    chunk->used = 0;
+    chunk->next = arena->spare;
+    arena->spare = chunk;
+    arena->spare_count++;
+  }
+  else {
+    free(chunk);
+  }
+}
+
+static void *
+arena_alloc(Arena *arena, size_t size)
+{
+  size_t needed = sizeof(ArenaHeader) + align_up(size);
+  ArenaChunk *chunk;
+
+  if (needed > ARENA_MAX_SHARED_ALLOC) {
+    chunk = chunk_new(arena, needed);
+    chunk->next = arena->pinned;
+    arena->pinned = chunk;
+  }
+  else {
+    chunk = arena->current;
+    if (chunk == NULL || chunk->used + needed > chunk->size) {
+      if (chunk != NULL) {
+        chunk->next = arena->pinned;
+        arena->pinned = chunk;
+      }
+      if (arena->spare != NULL) {
+        chunk = arena->spare;
+        arena->spare = chunk->next;
+        arena->spare_count--;
+        chunk->next = NULL;
+      }
+      else {
+        chunk = chunk_new(arena, ARENA_CHUNK_SIZE);
+      }
+      arena->current = chunk;
+    }
+  }
+
+  ArenaHeader *header = (ArenaHeader *)(chunk->data + chunk->used);
+  chunk->used += needed;
+  chunk->live++;
+  header->chunk = chunk;
+  header->size = size;
+  arena->arena_allocs++;
+
+  return header + 1;
+}
+
+static void *
+heap_alloc(size_t size)
+{
+  ArenaHeader *header = malloc(sizeof(ArenaHeader) + size);
+  if (header == NULL) {
+    return NULL;
+  }
+  if (t_arena != NULL) {
+    t_arena->heap_allocs++;
+  }
+  header->chunk = NULL;
+  header->size = size;
+
+  return header + 1;
+}
+
+static void *
+ts_arena_malloc(size_t size)
+{
+  if (t_arena != NULL && t_arena->active) {
+    return arena_alloc(t_arena, size);
+  }
+
+  return heap_alloc(size);
+}
+
+static void *
+ts_arena_calloc(size_t count, size_t size)
+{
+  size_t total = count * size;
+  if (size != 0 && total / size != count) {
+    return NULL;
+  }
+
+  void *ptr = ts_arena_malloc(total);
+  if (ptr != NULL) {
+    memset(ptr, 0, total);
+  }
+
+  return ptr;
+}
+
+static void
+ts_arena_free(void *ptr)
+{
+  if (ptr == NULL) {
+    return;
+  }
+
+  ArenaHeader *header = (ArenaHeader *)ptr - 1;
+  if (header->chunk != NULL) {
+    header->chunk->live--;
+  }
+  else {
+    free(header);
+  }
+}
+
+static void *
+ts_arena_realloc(void *ptr, size_t size)
+{
+  if (ptr == NULL) {
+    return ts_arena_malloc(size);
+  }
+
+  ArenaHeader *header = (ArenaHeader *)ptr - 1;
+  ArenaChunk *chunk = header->chunk;
+
+  // heap memory stays on the heap, this is how the parser's long-lived arrays grow
+  if (chunk == NULL) {
+    ArenaHeader *grown = realloc(header, sizeof(ArenaHeader) + size);
+    if (grown == NULL) {
+      return NULL;
+    }
+    if (t_arena != NULL) {
+      t_arena->heap_allocs++;
+    }
+    grown->size = size;
+    return grown + 1;
+  }
+
+  // grow in place when this is the most recent allocation of the current chunk
+  size_t old_end = (char *)ptr - chunk->data + align_up(header->size);
+  if (t_arena != NULL && t_arena->active && chunk == t_arena->current && old_end == chunk->used) {
+    size_t new_end = (char *)ptr - chunk->data + align_up(size);
+    if (new_end <= chunk->size) {
+      chunk->used = new_end;
+      header->size = size;
+      return ptr;
+    }
+  }
+
+  void *moved = ts_arena_malloc(size);
+  if (moved == NULL) {
+    return NULL;
+  }
+  memcpy(moved, ptr, header->size < size ? header->size : size);
+  ts_arena_free(ptr);
+
+  return moved;
+}
+
+void
+arena_install(void)
+{
+  ts_set_allocator(ts_arena_malloc, ts_arena_calloc, ts_arena_realloc, ts_arena_free);
+}
+
+void
+arena_init(Arena *arena)
+{
+  memset(arena, 0, sizeof(Arena));
+}
+
+void
+arena_destroy(Arena *arena)
+{
+  ArenaChunk *lists[] = { arena->current, arena->pinned, arena->spare };
+  for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+    ArenaChunk *chunk = lists[i];
+    while (chunk != NULL) {
+      ArenaChunk *next = chunk->next;
+      free(chunk);
+      chunk = next;
+    }
+  }
+  if (t_arena == arena) {
+    t_arena = NULL;
+  }
+  memset(arena, 0, sizeof(Arena));
+}
+
+void
+arena_bind(Arena *arena)
+{
+  t_arena = arena;
+}
+
+void
+arena_begin(Arena *arena)
+{
+  t_arena = arena;
+  arena->active = 1;
+}
+
+void
+arena_end(Arena *arena)
+{
+  arena->active = 0;
+
+  if (arena->current != NULL && arena->current->live == 0) {
+    arena->current->used = 0;
+  }
+
+  ArenaChunk **link = &arena->pinned;
+  while (*link != NULL) {
+    ArenaChunk *chunk = *link;
+    if (chunk->live == 0) {
+      *link = chunk->next;
+      chunk_release(arena, chunk);
+    }
+    else {
+      link = &chunk->next;
+    }
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct ArenaChunk ArenaChunk;
+
+// Per-thread bump allocator that tree-sitter allocates from while a file is
+// being parsed and queried. Every chunk counts its live allocations, and
+// arena_end() recycles each chunk whose count is zero in one step. The few
+// long-lived objects the parser keeps across files (its subtree pool,
+// growing arrays) only pin their own chunk until they are freed.
+//
+// Memory allocated from an arena must be freed on the thread that owns it.
+typedef struct {
+  ArenaChunk *current;
+  // chunks that still held live allocations at the last arena_end()
+  ArenaChunk *pinned;
+  ArenaChunk *spare;
+  int32_t spare_count;
+  int32_t active;
+  uint64_t arena_allocs;
+  uint64_t heap_allocs;
+} Arena;
+
+// Routes tree-sitter's allocator through this module; must run before any
+// other tree-sitter call.
+void arena_install(void);
+
+void arena_init(Arena *arena);
+void arena_destroy(Arena *arena);
+
+// Makes `arena` the calling thread's arena; allocations are only counted
+// against it until arena_begin() is called.
+void arena_bind(Arena *arena);
+
+// Serves the calling thread's tree-sitter allocations from its arena.
+void arena_begin(Arena *arena);
+
+// Goes back to the heap and releases every chunk with no live allocations.
+void arena_end(Arena *arena);
+
+#endif  // ARENA_H_
@@ -0,0 +1,182 @@
+// Counts heap allocations per file for the old per-file parser setup and for
+// the per-worker parser with an arena.
+//
+// Built and run by `make bench`, or on its own:
+//   make build/allocs
+//   build/allocs vendor/tree-sitter-c/examples/*.c
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "tree_sitter/api.h"
+#include "../arena.h"
+
+TSLanguage *tree_sitter_c();
+
+#define TS_C_field_declarator 7
+#define TS_C_field_type 23
+
+uint64_t g_mallocs;
+
+void *
+counting_malloc(size_t size)
+{
+  g_mallocs++;
+  return malloc(size);
+}
+
+void *
+counting_calloc(size_t count, size_t size)
+{
+  g_mallocs++;
+  return calloc(count, size);
+}
+
+void *
+counting_realloc(void *ptr, size_t size)
+{
+  g_mallocs++;
+  return realloc(ptr, size);
+}
+
+char *
+read_source(const char *path, uint32_t *length)
+{
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "err: could not open file: %s\n", path);
+    exit(1);
+  }
+  fseek(f, 0, SEEK_END);
+  *length = ftell(f);
+  rewind(f);
+  char *contents = malloc(*length + 1);
+  if (contents == NULL || fread(contents, 1, *length, f) != *length) {
+    fprintf(stderr, "err: could not read file: %s\n", path);
+    exit(1);
+  }
+  contents[*length] = '\0';
+  fclose(f);
+
+  return contents;
+}
+
+// Text extraction as process_file did it before: two callocs per match.
+void
+copy_node_text(TSNode node, const char *source)
+{
+  uint32_t start = ts_node_start_byte(node);
+  uint32_t end = ts_node_end_byte(node);
+  char *text = counting_calloc(1, end - start + 1);
+  memcpy(text, source + start, end - start);
+  free(text);
+}
+
+uint64_t
+run_before(TSQuery *query, char **sources, uint32_t *lengths, int count)
+{
+  ts_set_allocator(counting_malloc, counting_calloc, counting_realloc, free);
+  g_mallocs = 0;
+
+  for (int i = 0; i < count; i++) {
+    TSParser *parser = ts_parser_new();
+    ts_parser_set_language(parser, tree_sitter_c());
+    TSTree *tree = ts_parser_parse_string(parser, NULL, sources[i], lengths[i]);
+    TSQueryCursor *cursor = ts_query_cursor_new();
+    ts_query_cursor_exec(cursor, query, ts_tree_root_node(tree));
+
+    TSQueryMatch match;
+    while (ts_query_cursor_next_match(cursor, &match)) {
+      for (int j = 0; j < match.capture_count; j++) {
+        TSNode node = match.captures[j].node;
+        copy_node_text(ts_node_child_by_field_id(node, TS_C_field_type), sources[i]);
+        copy_node_text(ts_node_child_by_field_id(node, TS_C_field_declarator), sources[i]);
+      }
+    }
+
+    ts_query_cursor_delete(cursor);
+    ts_tree_delete(tree);
+    ts_parser_delete(parser);
+  }
+
+  return g_mallocs;
+}
+
+void
+run_after(TSQuery *query, char **sources, uint32_t *lengths, int count, Arena *arena)
+{
+  arena_install();
+  arena_init(arena);
+  arena_bind(arena);
+  TSParser *parser = ts_parser_new();
+  ts_parser_set_language(parser, tree_sitter_c());
+  TSQueryCursor *cursor = ts_query_cursor_new();
+
+  // setup is paid once per worker, not per file
+  arena->heap_allocs = 0;
+  arena->arena_allocs = 0;
+
+  for (int i = 0; i < count; i++) {
+    arena_begin(arena);
+    TSTree *tree = ts_parser_parse_string(parser, NULL, sources[i], lengths[i]);
+    ts_query_cursor_exec(cursor, query, ts_tree_root_node(tree));
+
+    TSQueryMatch match;
+    while (ts_query_cursor_next_match(cursor, &match)) {
+    }
+
+    ts_tree_delete(tree);
+    ts_parser_reset(parser);
+    arena_end(arena);
+  }
+
+  ts_query_cursor_delete(cursor);
+  ts_parser_delete(parser);
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s file.c...\n", argv[0]);
+    return 1;
+  }
+
+  int count = argc - 1;
+  char **sources = calloc(count, sizeof(char *));
+  uint32_t *lengths = calloc(count, sizeof(uint32_t));
+  for (int i = 0; i < count; i++) {
+    sources[i] = read_source(argv[i + 1], &lengths[i]);
+  }
+
+  uint32_t error_offset;
+  TSQueryError error_type;
+  const char *query_text = "((function_definition) @func)";
+
+  // each run uses a query made under its own allocator
+  TSQuery *query = ts_query_new(tree_sitter_c(), query_text, strlen(query_text), &error_offset, &error_type);
+  uint64_t before = run_before(query, sources, lengths, count);
+  ts_query_delete(query);
+
+  Arena arena;
+  arena_install();
+  query = ts_query_new(tree_sitter_c(), query_text, strlen(query_text), &error_offset, &error_type);
+  run_after(query, sources, lengths, count, &arena);
+  uint64_t heap_after = arena.heap_allocs;
+  uint64_t arena_after = arena.arena_allocs;
+  arena_destroy(&arena);
+  ts_query_delete(query);
+
+  printf("files: %d\n", count);
+  printf("before: %.1f heap allocations per file\n", (double)before / count);
+  printf("after:  %.1f heap allocations per file (%.1f served by the arena)\n",
+         (double)heap_after / count, (double)arena_after / count);
+
+  for (int i = 0; i < count; i++) {
+    free(sources[i]);
+  }
+  free(sources);
+  free(lengths);
+
+  return 0;
+}
@@ -0,0 +1,151 @@
+// Writes a synthetic C tree with a given number of function definitions for
+// `make bench`. Files hold a varying number of functions of varying size so
+// per-file latency has a spread, and the output is the same on every run.
+//
+//   corpus dir functions [functions-per-file]
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define FILES_PER_DIR 100
+#define DEFAULT_FUNCTIONS_PER_FILE 20
+
+uint64_t g_state = 0x2545f4914f6cdd1dull;
+
+uint32_t
+next_random(uint32_t bound)
+{
+  g_state ^= g_state << 13;
+  g_state ^= g_state >> 7;
+  g_state ^= g_state << 17;
+  return (uint32_t)(g_state % bound);
+}
+
+void
+make_dir(const char *path)
+{
+  if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "err: could not create directory: %s\n", path);
+    exit(1);
+  }
+}
+
+void
+write_function(FILE *f, uint64_t id)
+{
+  static const struct {
+    const char *type;
+    const char *ret;
+  } kinds[] = {
+    { "int", "  return total;\n" },
+    { "static int", "  return total;\n" },
+    { "void", "  (void)total;\n" },
+    { "static const char *", "  return total > 0 ? \"yes\" : \"no\";\n" },
+    { "size_t", "  return total;\n" },
+    { "struct item *", "  return total > 0 ? items : NULL;\n" },
+  };
+  uint32_t kind = next_random(sizeof(kinds) / sizeof(kinds[0]));
+  const char *type = kinds[kind].type;
+
+  fprintf(f, "// function %llu\n", (unsigned long long)id);
+  fprintf(f, "%s\nfn_%llu(struct item *items, size_t count, int flags)\n{\n", type, (unsigned long long)id);
+  fprintf(f, "  size_t total = 0;\n");
+
+  uint32_t statements = 1 + next_random(24);
+  for (uint32_t i = 0; i < statements; i++) {
+    switch (next_random(4)) {
+    case 0:
+      fprintf(f, "  for (size_t i = 0; i < count; i++) {\n"
+                 "    if (items[i].flags & (flags | %u)) {\n"
+                 "      total += items[i].value * %u;\n"
+                 "    }\n"
+                 "  }\n", i, next_random(100));
+      break;
+    case 1:
+      fprintf(f, "  switch (flags %% %u) {\n"
+                 "  case 0:\n"
+                 "    total ^= ITEM_MASK(total);\n"
+                 "    break;\n"
+                 "  default:\n"
+                 "    total += count;\n"
+                 "  }\n", 2 + next_random(7));
+      break;
+    case 2:
+      fprintf(f, "  while (total > %u && count > 0) {\n"
+                 "    total = total / 2 + items[--count].value;\n"
+                 "  }\n", next_random(1 << 16));
+      break;
+    default:
+      fprintf(f, "  total += helper_%u(items, count, \"%llu\");\n",
+              next_random(64), (unsigned long long)id);
+      break;
+    }
+  }
+
+  fprintf(f, "%s}\n\n", kinds[kind].ret);
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s dir functions [functions-per-file]\n", argv[0]);
+    return 1;
+  }
+
+  const char *root = argv[1];
+  uint64_t functions = strtoull(argv[2], NULL, 10);
+  uint32_t per_file = argc > 3 ? (uint32_t)atoi(argv[3]) : DEFAULT_FUNCTIONS_PER_FILE;
+  if (per_file < 1) {
+    fprintf(stderr, "err: invalid functions per file: %s\n", argv[3]);
+    return 1;
+  }
+
+  make_dir(root);
+
+  uint64_t written = 0;
+  uint64_t file = 0;
+  char path[4096];
+  while (written < functions) {
+    if (file % FILES_PER_DIR == 0) {
+      snprintf(path, sizeof(path), "%s/d%04llu", root, (unsigned long long)(file / FILES_PER_DIR));
+      make_dir(path);
+    }
+    snprintf(path, sizeof(path), "%s/d%04llu/f%06llu.c", root,
+             (unsigned long long)(file / FILES_PER_DIR), (unsigned long long)file);
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+      fprintf(stderr, "err: could not create file: %s\n", path);
+      return 1;
+    }
+
+    fprintf(f, "#include <stddef.h>\n\n"
+               "#define ITEM_MASK(x) ((x) & 0xff)\n\n"
+               "struct item {\n  int flags;\n  size_t value;\n};\n\n"
+               "size_t helper_%u(struct item *items, size_t count, const char *tag);\n\n",
+            next_random(64));
+
+    // anywhere from one function to twice the average
+    uint64_t count = 1 + next_random(2 * per_file);
+    if (count > functions - written) {
+      count = functions - written;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+      write_function(f, written + i);
+    }
+
+    if (fclose(f) != 0) {
+      fprintf(stderr, "err: could not write file: %s\n", path);
+      return 1;
+    }
+    written += count;
+    file++;
+  }
+
+  printf("%llu functions in %llu files\n", (unsigned long long)written, (unsigned long long)file);
+  return 0;
+}
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Runs the whole pipeline with --stats over generated corpora and over the
+# large tree-sitter-c examples, then counts allocations per file. Started by
+# `make bench`, which sets BUILD and BENCH_FUNCTIONS.
+
+set -e
+
+BUILD=${BUILD:-build}
+BENCH_FUNCTIONS=${BENCH_FUNCTIONS:-"1000 10000 100000"}
+BENCH_DIR=$(mktemp -d "${TMPDIR:-/tmp}/ls-funcs-bench.XXXXXX")
+trap 'rm -rf "$BENCH_DIR"' EXIT
+
+run() {
+  echo "== $1"
+  shift
+  "$BUILD/ls-funcs" --stats "$@" > /dev/null
+  echo
+}
+
+for functions in $BENCH_FUNCTIONS; do
+  "$BUILD/corpus" "$BENCH_DIR/corpus-$functions" "$functions" > /dev/null
+  run "synthetic corpus, $functions functions" "$BENCH_DIR/corpus-$functions"
+done
+
+# single large files, where parse time dominates and only one worker is busy
+for example in cluster parser; do
+  mkdir "$BENCH_DIR/$example"
+  cp "vendor/tree-sitter-c/examples/$example.c" "$BENCH_DIR/$example/"
+  run "vendor/tree-sitter-c/examples/$example.c" "$BENCH_DIR/$example"
+done
+
+echo "== allocations"
+"$BUILD/allocs" vendor/tree-sitter-c/examples/*.c
@@ -0,0 +1,306 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "index.h"
+
+static uint32_t
+pad4(uint32_t n)
+{
+  return (n + 3) & ~3u;
+}
+
+int32_t
+index_load(Index *index, const char *path, uint64_t queries_hash)
+{
+  memset(index, 0, sizeof(Index));
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IndexHeader)) {
+    close(fd);
+    return 0;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return 0;
+  }
+
+  const IndexHeader *header = data;
+  uint64_t entries_end = sizeof(IndexHeader) + (uint64_t)header->count * sizeof(IndexEntry);
+  if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0
+      || header->version != INDEX_VERSION
+      || entries_end > header->data_offset
+      || header->data_offset > (uint64_t)st.st_size
+      || header->data_length > (uint64_t)st.st_size - header->data_offset) {
+    munmap(data, st.st_size);
+    return 0;
+  }
+
+  if (header->queries_hash != queries_hash) {
+    munmap(data, st.st_size);
+    return 1;
+  }
+
+  const IndexEntry *entries = (const IndexEntry *)((const char *)data + sizeof(IndexHeader));
+  for (uint32_t i = 0; i < header->count; i++) {
+    const IndexEntry *e = &entries[i];
+    if (e->path_offset + e->path_length > header->data_length
+        || e->functions_offset + e->functions_length > header->data_length) {
+      munmap(data, st.st_size);
+      return 0;
+    }
+  }
+
+  index->data = data;
+  index->length = st.st_size;
+  index->header = header;
+  index->entries = entries;
+  return 1;
+}
+
+void
+index_close(Index *index)
+{
+  if (index->data != NULL) {
+    munmap((void *)index->data, index->length);
+  }
+  memset(index, 0, sizeof(Index));
+}
+
+static int
+compare_paths(const char *a, size_t a_length, const char *b, size_t b_length)
+{
+  int cmp = memcmp(a, b, a_length < b_length ? a_length : b_length);
+  if (cmp != 0) {
+    return cmp;
+  }
+
+  return (a_length > b_length) - (a_length < b_length);
+}
+
+const IndexEntry *
+index_find(const Index *index, const char *path)
+{
+  if (index->header == NULL) {
+    return NULL;
+  }
+
+  const char *base = index->data + index->header->data_offset;
+  size_t path_length = strlen(path);
+  uint32_t lo = 0;
+  uint32_t hi = index->header->count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    const IndexEntry *e = &index->entries[mid];
+    int cmp = compare_paths(base + e->path_offset, e->path_length, path, path_length);
+    if (cmp == 0) {
+      return e;
+    }
+    if (cmp < 0) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  return NULL;
+}
+
+const char *
+index_entry_functions(const Index *index, const IndexEntry *entry)
+{
+  return index->data + index->header->data_offset + entry->functions_offset;
+}
+
+int32_t
+index_next_function(const char **cursor, const char *end, IndexFunction *function,
+                    const char **kind, const char **type, const char **declarator)
+{
+  if ((size_t)(end - *cursor) < sizeof(IndexFunction)) {
+    return 0;
+  }
+
+  memcpy(function, *cursor, sizeof(IndexFunction));
+  const char *text = *cursor + sizeof(IndexFunction);
+  uint64_t text_length = (uint64_t)function->kind_length + function->type_length + function->declarator_length;
+  if (text_length > (uint64_t)(end - text)) {
+    return 0;
+  }
+
+  *kind = text;
+  *type = text + function->kind_length;
+  *declarator = *type + function->type_length;
+  const char *next = text + pad4(text_length);
+  *cursor = next < end ? next : end;
+  return 1;
+}
+
+static void
+buffer_reserve(IndexBuffer *buffer, uint32_t additional)
+{
+  if (buffer->length + additional <= buffer->size) {
+    return;
+  }
+
+  uint32_t size = buffer->size > 0 ? buffer->size : 1024;
+  while (size < buffer->length + additional) {
+    size *= 2;
+  }
+  buffer->data = realloc(buffer->data, size);
+  if (buffer->data == NULL) {
+    fprintf(stderr, "err: could not allocate memory for index\n");
+    exit(1);
+  }
+  buffer->size = size;
+}
+
+void
+index_buffer_append_function(IndexBuffer *buffer, uint32_t start_byte, uint32_t end_byte,
+                             uint32_t start_row, uint32_t start_column,
+                             const char *kind, uint32_t kind_length,
+                             const char *type, uint32_t type_length,
+                             const char *declarator, uint32_t declarator_length)
+{
+  uint32_t unpadded = kind_length + type_length + declarator_length;
+  uint32_t text_length = pad4(unpadded);
+  buffer_reserve(buffer, sizeof(IndexFunction) + text_length);
+
+  IndexFunction function = {
+    start_byte, end_byte, start_row, start_column, kind_length, type_length, declarator_length
+  };
+  char *out = buffer->data + buffer->length;
+  memcpy(out, &function, sizeof(IndexFunction));
+  out += sizeof(IndexFunction);
+  memcpy(out, kind, kind_length);
+  memcpy(out + kind_length, type, type_length);
+  memcpy(out + kind_length + type_length, declarator, declarator_length);
+  memset(out + unpadded, 0, text_length - unpadded);
+  buffer->length += sizeof(IndexFunction) + text_length;
+}
+
+void
+index_buffer_append(IndexBuffer *buffer, const IndexBuffer *other)
+{
+  if (other->length == 0) {
+    return;
+  }
+
+  buffer_reserve(buffer, other->length);
+  memcpy(buffer->data + buffer->length, other->data, other->length);
+  buffer->length += other->length;
+}
+
+uint64_t
+index_hash(const char *data, size_t length)
+{
+  const uint64_t m = 0x9e3779b97f4a7c15ull;
+  uint64_t h = length * m;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t w;
+    memcpy(&w, data + i, 8);
+    h = (h ^ w) * m;
+    h ^= h >> 29;
+  }
+
+  uint64_t tail = 0;
+  memcpy(&tail, data + i, length - i);
+  h = (h ^ tail) * m;
+  h ^= h >> 32;
+  h *= 0xbf58476d1ce4e5b9ull;
+  return h ^ (h >> 31);
+}
+
+static int
+compare_records(const void *a, const void *b)
+{
+  const IndexRecord *ra = a;
+  const IndexRecord *rb = b;
+  return compare_paths(ra->path, strlen(ra->path), rb->path, strlen(rb->path));
+}
+
+int32_t
+index_write(const char *path, uint64_t queries_hash, IndexRecord *records, int32_t count)
+{
+  qsort(records, count, sizeof(IndexRecord), compare_records);
+
+  size_t tmp_length = strlen(path) + 5;
+  char *tmp_path = malloc(tmp_length);
+  if (tmp_path == NULL) {
+    return 0;
+  }
+  snprintf(tmp_path, tmp_length, "%s.tmp", path);
+
+  FILE *f = fopen(tmp_path, "wb");
+  if (f == NULL) {
+    free(tmp_path);
+    return 0;
+  }
+
+  IndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.version = INDEX_VERSION;
+  header.count = count;
+  header.queries_hash = queries_hash;
+  header.data_offset = sizeof(IndexHeader) + (uint64_t)count * sizeof(IndexEntry);
+
+  uint64_t offset = 0;
+  for (int32_t i = 0; i < count; i++) {
+    offset += pad4(strlen(records[i].path));
+    offset += records[i].functions_length;
+  }
+  header.data_length = offset;
+
+  int32_t ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+  offset = 0;
+  for (int32_t i = 0; ok && i < count; i++) {
+    IndexRecord *r = &records[i];
+    IndexEntry entry;
+    entry.path_length = strlen(r->path);
+    entry.path_offset = offset;
+    offset += pad4(entry.path_length);
+    entry.functions_offset = offset;
+    entry.functions_length = r->functions_length;
+    offset += r->functions_length;
+    entry.mtime_sec = r->mtime_sec;
+    entry.mtime_nsec = r->mtime_nsec;
+    entry.size = r->size;
+    entry.hash = r->hash;
+    ok = fwrite(&entry, sizeof(entry), 1, f) == 1;
+  }
+
+  static const char zeros[4] = { 0 };
+  for (int32_t i = 0; ok && i < count; i++) {
+    IndexRecord *r = &records[i];
+    uint32_t path_length = strlen(r->path);
+    ok = fwrite(r->path, 1, path_length, f) == path_length
+      && fwrite(zeros, 1, pad4(path_length) - path_length, f) == pad4(path_length) - path_length
+      && (r->functions_length == 0 || fwrite(r->functions, 1, r->functions_length, f) == r->functions_length);
+  }
+
+  if (fclose(f) != 0) {
+    ok = 0;
+  }
+  if (ok) {
+    ok = rename(tmp_path, path) == 0;
+  }
+  if (!ok) {
+    unlink(tmp_path);
+  }
+  free(tmp_path);
+
+  return ok;
+}
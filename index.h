@@ -0,0 +1,101 @@
+#ifndef INDEX_H_
+#define INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// On-disk cache of the functions extracted from each file, keyed on path and
+// validated with mtime, size and a content hash. The file is a header, an
+// array of IndexEntry sorted by path, then a data section with the paths and
+// per-file function blobs. It is mmapped as-is, so every field is fixed size
+// and in host byte order.
+
+#define INDEX_MAGIC "LSFIDX\0\0"
+#define INDEX_VERSION 3
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  // results depend on the queries, an index built with others is ignored
+  uint64_t queries_hash;
+  uint64_t data_offset;
+  uint64_t data_length;
+} IndexHeader;
+
+typedef struct {
+  uint64_t path_offset;
+  uint64_t functions_offset;
+  uint32_t path_length;
+  uint32_t functions_length;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t size;
+  uint64_t hash;
+} IndexEntry;
+
+// One extracted result inside a blob, followed by its kind, type and
+// declarator text, then padding up to a multiple of 4 bytes. The byte range
+// is kept so changed files can be compared against what was there before.
+// Rows and columns are zero-based, as tree-sitter reports them.
+typedef struct {
+  uint32_t start_byte;
+  uint32_t end_byte;
+  uint32_t start_row;
+  uint32_t start_column;
+  uint32_t kind_length;
+  uint32_t type_length;
+  uint32_t declarator_length;
+} IndexFunction;
+
+typedef struct {
+  const char *data;
+  size_t length;
+  const IndexHeader *header;
+  const IndexEntry *entries;
+} Index;
+
+// What gets written for one file; `functions` is a blob of IndexFunction.
+typedef struct {
+  const char *path;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t size;
+  uint64_t hash;
+  const char *functions;
+  uint32_t functions_length;
+} IndexRecord;
+
+typedef struct {
+  char *data;
+  uint32_t length;
+  uint32_t size;
+} IndexBuffer;
+
+// Maps an index file. A missing or invalid file, or one built for other
+// queries, leaves `index` empty; the return value is 0 only for an invalid file.
+int32_t index_load(Index *index, const char *path, uint64_t queries_hash);
+void index_close(Index *index);
+
+const IndexEntry *index_find(const Index *index, const char *path);
+const char *index_entry_functions(const Index *index, const IndexEntry *entry);
+
+// Reads the function at `*cursor` and advances past it; returns 0 at `end`.
+int32_t index_next_function(const char **cursor, const char *end, IndexFunction *function,
+                            const char **kind, const char **type, const char **declarator);
+
+void index_buffer_append_function(IndexBuffer *buffer, uint32_t start_byte, uint32_t end_byte,
+                                  uint32_t start_row, uint32_t start_column,
+                                  const char *kind, uint32_t kind_length,
+                                  const char *type, uint32_t type_length,
+                                  const char *declarator, uint32_t declarator_length);
+
+// Appends everything in `other`.
+void index_buffer_append(IndexBuffer *buffer, const IndexBuffer *other);
+
+uint64_t index_hash(const char *data, size_t length);
+
+// Sorts `records` by path and replaces the file at `path` atomically.
+int32_t index_write(const char *path, uint64_t queries_hash, IndexRecord *records, int32_t count);
+
+#endif  // INDEX_H_
@@ -1,237 +1,2383 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <regex.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include "tree_sitter/api.h"
+#include "arena.h"
+#include "index.h"
+#include "output.h"
+#include "watch.h"
 
 TSLanguage *tree_sitter_c();
 
-#define TS_C_field_declarator 7
-#define TS_C_field_type 23
-#define NUM_THREADS 6
+#define QUEUE_CAPACITY 1024
+// long options without a short form
+#define OPTION_SORTED 256
+#define OPTION_MAX_SIZE 257
+#define OPTION_TIMEOUT 258
+#define OPTION_WATCH 259
+// smaller files are read into a buffer, mmap setup costs more than it saves
+#define MMAP_THRESHOLD (16 * 1024)
+// files at least this big are queried in slices by several workers
+#define SPLIT_THRESHOLD (256 * 1024)
+// smallest slice worth handing to another worker
+#define SPLIT_SLICE_MIN (64 * 1024)
 
-int32_t g_running = 1;
-TSQuery *g_query;
+typedef enum {
+  // the node a result is reported for; the capture name is its kind
+  CAPTURE_ITEM,
+  // overrides the item's `type` field
+  CAPTURE_TYPE,
+  // overrides the item's `declarator` field
+  CAPTURE_NAME,
+  // names starting with '_' only serve predicates and are not reported
+  CAPTURE_HIDDEN,
+} CaptureRole;
+
+// A #eq? or #match? predicate, or their #not- forms, on `capture`.
+typedef struct {
+  uint32_t capture;
+  int32_t is_match;
+  int32_t negated;
+  // #eq? compares with this capture, or with `string` when it is -1
+  int32_t other;
+  const char *string;
+  uint32_t string_length;
+  regex_t regex;
+} QueryPredicate;
+
+// A tree-sitter grammar, the files it handles and the queries compiled for
+// it. Other languages plug in by adding an entry to g_grammars.
+typedef struct {
+  const char *name;
+  TSLanguage *(*language)(void);
+  const char *extensions[4];
+  // used when no --query file is given for this grammar
+  const char *default_query;
+  const TSLanguage *ts_language;
+  TSQuery *query;
+  CaptureRole *roles;
+  // pattern i's predicates are predicates[pattern_predicates[i]] up to
+  // predicates[pattern_predicates[i + 1]]
+  QueryPredicate *predicates;
+  uint32_t *pattern_predicates;
+  TSFieldId type_field;
+  TSFieldId declarator_field;
+} Grammar;
+
+Grammar g_grammars[] = {
+  { .name = "c", .language = tree_sitter_c, .extensions = { ".c", ".h", NULL },
+    .default_query = "((function_definition) @function)" },
+};
+
+#define GRAMMARS_COUNT (int32_t)(sizeof(g_grammars) / sizeof(g_grammars[0]))
+
+Index g_index;
+uint64_t g_queries_hash;
+
+typedef struct {
+  char **excludes;
+  int32_t excludes_count;
+  char **queries;
+  int32_t queries_count;
+  int32_t follow_symlinks;
+  int32_t jobs;
+  int32_t stats;
+  char *index_path;
+  OutputFormat format;
+  int32_t sorted;
+  // 0 for no limit
+  uint64_t max_size;
+  uint64_t timeout_ms;
+  // --watch socket
+  char *watch_path;
+} Options;
+
+Options g_options;
+
+typedef struct SplitFile SplitFile;
+
+// A file or directory to visit. In --sorted mode `order` is its place in
+// the output order.
+typedef struct {
+  OrderNode *order;
+  // NULL for directories
+  Grammar *grammar;
+  // set on tasks that help query a large file another worker parsed
+  SplitFile *split;
+  // from the walker's stat when `has_stat`; larger files are taken first
+  int32_t has_stat;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  char path[];
+} PathTask;
+
+// `dir_path` may be NULL for root paths.
+PathTask *
+path_task_new(const char *dir_path, const char *name, OrderNode *order, Grammar *grammar)
+{
+  size_t dir_length = dir_path != NULL ? strlen(dir_path) + 1 : 0;
+  size_t name_length = strlen(name);
+  PathTask *task = malloc(sizeof(PathTask) + dir_length + name_length + 1);
+  if (task == NULL) {
+    fprintf(stderr, "err: could not allocate memory for file path\n");
+    exit(1);
+  }
+  task->order = order;
+  task->grammar = grammar;
+  task->split = NULL;
+  task->has_stat = 0;
+  task->size = 0;
+  if (dir_path != NULL) {
+    memcpy(task->path, dir_path, dir_length - 1);
+    task->path[dir_length - 1] = '/';
+  }
+  memcpy(task->path + dir_length, name, name_length + 1);
+
+  return task;
+}
+
+double
+now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Each worker's queued files, as a max-heap on size so the largest files
+// start first instead of becoming the tail of the run.
+typedef struct {
+  PathTask **data;
+  int32_t count;
+  int32_t size;
+  pthread_mutex_t lock;
+} WorkHeap;
+
+typedef struct {
+  WorkHeap *heaps;
+  int32_t num_workers;
+  int32_t capacity;
+  atomic_int next_heap;
+  // items sitting in heaps, bounded by capacity
+  atomic_int queued;
+  // items pushed but not yet marked done
+  atomic_int pending;
+  atomic_int idle_workers;
+  atomic_int waiting_producers;
+  atomic_int closed;
+  pthread_mutex_t lock;
+  pthread_cond_t work_available;
+  pthread_cond_t space_available;
+  pthread_cond_t all_done;
+} Scheduler;
+
+void
+scheduler_init(Scheduler *s, int32_t num_workers, int32_t capacity)
+{
+  s->num_workers = num_workers;
+  s->capacity = capacity;
+  s->heaps = calloc(num_workers, sizeof(WorkHeap));
+  if (s->heaps == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < num_workers; i++) {
+    WorkHeap *heap = &s->heaps[i];
+    // any single heap may end up holding everything the producer is allowed
+    // to queue, plus one helper task from every other worker
+    heap->size = capacity + num_workers;
+    heap->data = calloc(heap->size, sizeof(PathTask *));
+    if (heap->data == NULL) {
+      exit(1);
+    }
+    pthread_mutex_init(&heap->lock, NULL);
+  }
+  atomic_init(&s->next_heap, 0);
+  atomic_init(&s->queued, 0);
+  atomic_init(&s->pending, 0);
+  atomic_init(&s->idle_workers, 0);
+  atomic_init(&s->waiting_producers, 0);
+  atomic_init(&s->closed, 0);
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->work_available, NULL);
+  pthread_cond_init(&s->space_available, NULL);
+  pthread_cond_init(&s->all_done, NULL);
+}
+
+void
+scheduler_destroy(Scheduler *s)
+{
+  for (int i = 0; i < s->num_workers; i++) {
+    free(s->heaps[i].data);
+    pthread_mutex_destroy(&s->heaps[i].lock);
+  }
+  free(s->heaps);
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->work_available);
+  pthread_cond_destroy(&s->space_available);
+  pthread_cond_destroy(&s->all_done);
+}
+
+// Helper tasks rank above every file, the walker's files rank by size.
+uint64_t
+task_priority(const PathTask *task)
+{
+  return task->split != NULL ? UINT64_MAX : task->size;
+}
+
+PathTask *
+heap_pop(WorkHeap *heap)
+{
+  PathTask *data = NULL;
+  pthread_mutex_lock(&heap->lock);
+  if (heap->count > 0) {
+    data = heap->data[0];
+    PathTask *last = heap->data[--heap->count];
+    uint64_t priority = task_priority(last);
+    int32_t i = 0;
+    for (;;) {
+      int32_t child = 2 * i + 1;
+      if (child >= heap->count) {
+        break;
+      }
+      if (child + 1 < heap->count && task_priority(heap->data[child + 1]) > task_priority(heap->data[child])) {
+        child++;
+      }
+      if (task_priority(heap->data[child]) <= priority) {
+        break;
+      }
+      heap->data[i] = heap->data[child];
+      i = child;
+    }
+    heap->data[i] = last;
+  }
+  pthread_mutex_unlock(&heap->lock);
+
+  return data;
+}
+
+int32_t
+heap_push(WorkHeap *heap, PathTask *data)
+{
+  int32_t pushed = 0;
+  pthread_mutex_lock(&heap->lock);
+  if (heap->count < heap->size) {
+    uint64_t priority = task_priority(data);
+    int32_t i = heap->count++;
+    while (i > 0 && task_priority(heap->data[(i - 1) / 2]) < priority) {
+      heap->data[i] = heap->data[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    heap->data[i] = data;
+    pushed = 1;
+  }
+  pthread_mutex_unlock(&heap->lock);
+
+  return pushed;
+}
+
+void
+scheduler_wake(Scheduler *s, int32_t all)
+{
+  if (atomic_load(&s->idle_workers) > 0) {
+    pthread_mutex_lock(&s->lock);
+    if (all) {
+      pthread_cond_broadcast(&s->work_available);
+    }
+    else {
+      pthread_cond_signal(&s->work_available);
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+// Blocks while the scheduler already holds `capacity` queued items; returns
+// the seconds spent waiting for room.
+double
+scheduler_push(Scheduler *s, PathTask *data)
+{
+  double waited = 0;
+  if (atomic_load(&s->queued) >= s->capacity) {
+    double wait_start = now_seconds();
+    pthread_mutex_lock(&s->lock);
+    atomic_fetch_add(&s->waiting_producers, 1);
+    while (atomic_load(&s->queued) >= s->capacity) {
+      pthread_cond_wait(&s->space_available, &s->lock);
+    }
+    atomic_fetch_sub(&s->waiting_producers, 1);
+    pthread_mutex_unlock(&s->lock);
+    waited = now_seconds() - wait_start;
+  }
+
+  atomic_fetch_add(&s->pending, 1);
+  int32_t start = atomic_fetch_add(&s->next_heap, 1);
+  for (int i = 0; ; i++) {
+    WorkHeap *heap = &s->heaps[(start + i) % s->num_workers];
+    if (heap_push(heap, data)) {
+      break;
+    }
+  }
+  atomic_fetch_add(&s->queued, 1);
+
+  scheduler_wake(s, 0);
+  return waited;
+}
+
+// Queues a helper task on a given worker. Workers push these themselves, so
+// this never waits for room: a worker blocked here could not drain the queue.
+void
+scheduler_push_helper(Scheduler *s, int32_t worker_id, PathTask *data)
+{
+  atomic_fetch_add(&s->pending, 1);
+  for (int i = 0; ; i++) {
+    WorkHeap *heap = &s->heaps[(worker_id + i) % s->num_workers];
+    if (heap_push(heap, data)) {
+      break;
+    }
+  }
+  atomic_fetch_add(&s->queued, 1);
+
+  // the helper is meant for `worker_id`, but any idle worker may take it
+  scheduler_wake(s, 1);
+}
+
+PathTask *
+scheduler_try_take(Scheduler *s, int32_t worker_id)
+{
+  PathTask *data = heap_pop(&s->heaps[worker_id]);
+  for (int i = 1; data == NULL && i < s->num_workers; i++) {
+    data = heap_pop(&s->heaps[(worker_id + i) % s->num_workers]);
+  }
+
+  if (data != NULL) {
+    atomic_fetch_sub(&s->queued, 1);
+    if (atomic_load(&s->waiting_producers) > 0) {
+      pthread_mutex_lock(&s->lock);
+      pthread_cond_signal(&s->space_available);
+      pthread_mutex_unlock(&s->lock);
+    }
+  }
+
+  return data;
+}
+
+// Returns NULL once the scheduler is closed and drained.
+PathTask *
+scheduler_take(Scheduler *s, int32_t worker_id)
+{
+  for (;;) {
+    PathTask *data = scheduler_try_take(s, worker_id);
+    if (data != NULL) {
+      return data;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    atomic_fetch_add(&s->idle_workers, 1);
+    while (atomic_load(&s->queued) == 0 && !atomic_load(&s->closed)) {
+      pthread_cond_wait(&s->work_available, &s->lock);
+    }
+    atomic_fetch_sub(&s->idle_workers, 1);
+    int32_t finished = atomic_load(&s->queued) == 0 && atomic_load(&s->closed);
+    pthread_mutex_unlock(&s->lock);
+
+    if (finished) {
+      return NULL;
+    }
+  }
+}
+
+void
+scheduler_done(Scheduler *s)
+{
+  if (atomic_fetch_sub(&s->pending, 1) == 1) {
+    pthread_mutex_lock(&s->lock);
+    pthread_cond_broadcast(&s->all_done);
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+// No more pushes after this; wakes idle workers so they can exit once drained.
+void
+scheduler_close(Scheduler *s)
+{
+  pthread_mutex_lock(&s->lock);
+  atomic_store(&s->closed, 1);
+  pthread_cond_broadcast(&s->work_available);
+  pthread_mutex_unlock(&s->lock);
+}
+
+void
+scheduler_wait(Scheduler *s)
+{
+  pthread_mutex_lock(&s->lock);
+  while (atomic_load(&s->pending) > 0) {
+    pthread_cond_wait(&s->all_done, &s->lock);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+typedef struct {
+  Scheduler *scheduler;
+  int32_t id;
+  TSParser *parser;
+  TSQueryCursor *cursor;
+  Arena arena;
+  uint64_t arena_allocs;
+  uint64_t heap_allocs;
+  uint64_t files_read;
+  uint64_t bytes_read;
+  uint64_t files_cached;
+  uint64_t files_skipped;
+  uint64_t files_split;
+  // --stats: time spent in each stage and waiting for the queue
+  double read_seconds;
+  double parse_seconds;
+  double query_seconds;
+  double busy_seconds;
+  double wait_seconds;
+  double *latencies;
+  int32_t latencies_count;
+  int32_t latencies_size;
+  OutputLocal output;
+  IndexBuffer functions;
+  IndexRecord *records;
+  int32_t records_count;
+  int32_t records_size;
+  // set when this worker saw a file the current index does not describe exactly
+  int32_t index_dirty;
+} Worker;
+
+typedef struct {
+  const char *data;
+  uint32_t length;
+  int32_t mapped;
+  int32_t regular;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} SourceFile;
+
+// Reads fds without a usable size (pipes, small files) into a heap buffer.
+int32_t
+source_read_buffered(SourceFile *src, int fd, size_t size_hint)
+{
+  size_t size = size_hint > 0 ? size_hint : 4096;
+  size_t length = 0;
+  char *data = malloc(size);
+  if (data == NULL) {
+    return 0;
+  }
+
+  for (;;) {
+    if (length == size) {
+      size *= 2;
+      char *grown = realloc(data, size);
+      if (grown == NULL) {
+        free(data);
+        return 0;
+      }
+      data = grown;
+    }
+    ssize_t n = read(fd, data + length, size - length);
+    if (n < 0) {
+      free(data);
+      return 0;
+    }
+    if (n == 0) {
+      break;
+    }
+    length += n;
+  }
+
+  if (length > UINT32_MAX) {
+    free(data);
+    return 0;
+  }
+  src->data = data;
+  src->length = length;
+  src->mapped = 0;
+  return 1;
+}
+
+int32_t
+source_open(SourceFile *src, const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "err: could not open file: %s\n", path);
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "err: could not stat file: %s\n", path);
+    close(fd);
+    return 0;
+  }
+
+  src->regular = S_ISREG(st.st_mode);
+  src->mtime_sec = st.st_mtim.tv_sec;
+  src->mtime_nsec = st.st_mtim.tv_nsec;
+
+  if (S_ISREG(st.st_mode) && (uint64_t)st.st_size > UINT32_MAX) {
+    fprintf(stderr, "err: file too large to parse: %s\n", path);
+    close(fd);
+    return 0;
+  }
+
+  if (S_ISREG(st.st_mode) && st.st_size >= MMAP_THRESHOLD) {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      // pages are faulted in lazily while parsing; only --stats pays to fault
+      // them in here, so reading shows up as read time and not parse time
+      if (g_options.stats) {
+        madvise(data, st.st_size, MADV_WILLNEED);
+        volatile char touch = 0;
+        for (off_t offset = 0; offset < st.st_size; offset += 4096) {
+          touch += ((const char *)data)[offset];
+        }
+        (void)touch;
+      }
+      close(fd);
+      src->data = data;
+      src->length = st.st_size;
+      src->mapped = 1;
+      return 1;
+    }
+  }
+
+  size_t size_hint = S_ISREG(st.st_mode) ? st.st_size + 1 : 0;
+  int32_t ok = source_read_buffered(src, fd, size_hint);
+  close(fd);
+  if (!ok) {
+    fprintf(stderr, "err: could not read file: %s\n", path);
+  }
+
+  return ok;
+}
+
+void
+source_close(SourceFile *src)
+{
+  if (src->mapped) {
+    munmap((void *)src->data, src->length);
+  }
+  else {
+    free((void *)src->data);
+  }
+}
+
+const char *
+source_read(void *payload, uint32_t byte_index, TSPoint position, uint32_t *bytes_read)
+{
+  (void)position;
+  SourceFile *src = (SourceFile *)payload;
+  if (byte_index >= src->length) {
+    *bytes_read = 0;
+    return "";
+  }
+  *bytes_read = src->length - byte_index;
+  return src->data + byte_index;
+}
+
+typedef struct {
+  uint32_t offset;
+  uint32_t length;
+} TextSlice;
+
+TextSlice
+get_node_text(TSNode node)
+{
+  if (ts_node_is_null(node)) {
+    return (TextSlice){ 0, 0 };
+  }
+
+  uint32_t start = ts_node_start_byte(node);
+  uint32_t end = ts_node_end_byte(node);
+  return (TextSlice){ start, end - start };
+}
+
+void
+output_cached_functions(OutputBatch *batch, const char *path, const char *functions, uint32_t length)
+{
+  if (batch == NULL) {
+    return;
+  }
+
+  const char *cursor = functions;
+  const char *end = functions + length;
+  IndexFunction function;
+  const char *kind;
+  const char *type;
+  const char *declarator;
+  while (index_next_function(&cursor, end, &function, &kind, &type, &declarator)) {
+    output_function(batch, path, function.start_row + 1, function.start_column + 1,
+                    function.start_byte, function.end_byte, kind, function.kind_length,
+                    type, function.type_length, declarator, function.declarator_length);
+  }
+}
+
+void
+record_file(Worker *worker, const char *path, int64_t mtime_sec, int64_t mtime_nsec,
+            uint64_t size, uint64_t hash, const char *functions, uint32_t functions_length)
+{
+  if (worker->records_count + 1 > worker->records_size) {
+    worker->records_size = worker->records_size > 0 ? worker->records_size * 2 : 256;
+    worker->records = realloc(worker->records, worker->records_size * sizeof(IndexRecord));
+    if (worker->records == NULL) {
+      fprintf(stderr, "err: could not allocate memory for index\n");
+      exit(1);
+    }
+  }
+
+  char *path_copy = strdup(path);
+  if (path_copy == NULL) {
+    fprintf(stderr, "err: could not allocate memory for index\n");
+    exit(1);
+  }
+
+  worker->records[worker->records_count++] = (IndexRecord){
+    path_copy, mtime_sec, mtime_nsec, size, hash, functions, functions_length
+  };
+}
+
+void
+record_latency(Worker *worker, double seconds)
+{
+  if (worker->latencies_count + 1 > worker->latencies_size) {
+    worker->latencies_size = worker->latencies_size > 0 ? worker->latencies_size * 2 : 1024;
+    worker->latencies = realloc(worker->latencies, worker->latencies_size * sizeof(double));
+    if (worker->latencies == NULL) {
+      fprintf(stderr, "err: could not allocate memory for stats\n");
+      exit(1);
+    }
+  }
+  worker->latencies[worker->latencies_count++] = seconds;
+}
+
+int32_t
+is_index_memory(const char *ptr)
+{
+  return g_index.data != NULL && ptr >= g_index.data && ptr < g_index.data + g_index.length;
+}
+
+int32_t
+predicate_holds(const QueryPredicate *predicate, const TSQueryMatch *match, TSNode node,
+                const char *text)
+{
+  TextSlice value = get_node_text(node);
+  if (predicate->is_match) {
+    char buffer[256];
+    char *copy = value.length < sizeof(buffer) ? buffer : malloc(value.length + 1);
+    if (copy == NULL) {
+      fprintf(stderr, "err: could not allocate memory for predicate\n");
+      exit(1);
+    }
+    memcpy(copy, text + value.offset, value.length);
+    copy[value.length] = '\0';
+    int32_t matched = regexec(&predicate->regex, copy, 0, NULL, 0) == 0;
+    if (copy != buffer) {
+      free(copy);
+    }
+    return matched != predicate->negated;
+  }
+
+  const char *expected = predicate->string;
+  uint32_t expected_length = predicate->string_length;
+  if (predicate->other >= 0) {
+    // a capture missing from the match does not constrain it
+    TSNode other = { 0 };
+    for (int i = 0; i < match->capture_count; i++) {
+      if (match->captures[i].index == (uint32_t)predicate->other) {
+        other = match->captures[i].node;
+        break;
+      }
+    }
+    if (ts_node_is_null(other)) {
+      return 1;
+    }
+    TextSlice other_text = get_node_text(other);
+    expected = text + other_text.offset;
+    expected_length = other_text.length;
+  }
+  int32_t equal = value.length == expected_length
+    && memcmp(text + value.offset, expected, expected_length) == 0;
+  return equal != predicate->negated;
+}
+
+// Tree-sitter leaves predicates to the caller; every node a predicate's
+// capture matched has to satisfy it.
+int32_t
+match_passes(const Grammar *grammar, const TSQueryMatch *match, const char *text)
+{
+  uint32_t end = grammar->pattern_predicates[match->pattern_index + 1];
+  for (uint32_t p = grammar->pattern_predicates[match->pattern_index]; p < end; p++) {
+    const QueryPredicate *predicate = &grammar->predicates[p];
+    for (int i = 0; i < match->capture_count; i++) {
+      if (match->captures[i].index == predicate->capture
+          && !predicate_holds(predicate, match, match->captures[i].node, text)) {
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+// Runs the grammar's query over `root` and emits every item that starts in
+// [start_byte, end_byte); items starting elsewhere belong to another slice.
+// `batch` is NULL with --watch, `functions` when results are not kept.
+void
+query_range(Worker *worker, Grammar *grammar, TSNode root, const char *path, const char *text,
+            uint32_t start_byte, uint32_t end_byte, OutputBatch *batch, IndexBuffer *functions)
+{
+  double query_start = now_seconds();
+
+  // all extractors share one query, so this is the only pass over the tree
+  ts_query_cursor_set_byte_range(worker->cursor, start_byte, end_byte);
+  ts_query_cursor_exec(worker->cursor, grammar->query, root);
+
+  TSQueryMatch match;
+  while(ts_query_cursor_next_match(worker->cursor, &match)) {
+    if (!match_passes(grammar, &match, text)) {
+      continue;
+    }
+
+    TSNode type_override = { 0 };
+    TSNode name_override = { 0 };
+    for (int i = 0; i < match.capture_count; i++) {
+      CaptureRole role = grammar->roles[match.captures[i].index];
+      if (role == CAPTURE_TYPE) {
+        type_override = match.captures[i].node;
+      }
+      else if (role == CAPTURE_NAME) {
+        name_override = match.captures[i].node;
+      }
+    }
+
+    for (int i = 0; i < match.capture_count; i++) {
+      if (grammar->roles[match.captures[i].index] != CAPTURE_ITEM) {
+        continue;
+      }
+      TSNode node = match.captures[i].node;
+      uint32_t node_start = ts_node_start_byte(node);
+      if (node_start < start_byte || node_start >= end_byte) {
+        continue;
+      }
+
+      uint32_t kind_length;
+      const char *kind = ts_query_capture_name_for_id(grammar->query, match.captures[i].index, &kind_length);
+      TSNode type = !ts_node_is_null(type_override)
+        ? type_override
+        : ts_node_child_by_field_id(node, grammar->type_field);
+      TSNode declarator = !ts_node_is_null(name_override)
+        ? name_override
+        : ts_node_child_by_field_id(node, grammar->declarator_field);
+
+      TSPoint start = ts_node_start_point(node);
+      TextSlice type_text = get_node_text(type);
+      TextSlice declarator_text = get_node_text(declarator);
+      if (batch != NULL) {
+        output_function(batch, path, start.row + 1, start.column + 1,
+                        node_start, ts_node_end_byte(node), kind, kind_length,
+                        text + type_text.offset, type_text.length,
+                        text + declarator_text.offset, declarator_text.length);
+      }
+
+      if (functions != NULL) {
+        index_buffer_append_function(functions, node_start, ts_node_end_byte(node),
+                                     start.row, start.column, kind, kind_length,
+                                     text + type_text.offset, type_text.length,
+                                     text + declarator_text.offset, declarator_text.length);
+      }
+    }
+  }
+
+  worker->query_seconds += now_seconds() - query_start;
+}
+
+typedef struct {
+  uint32_t start_byte;
+  uint32_t end_byte;
+  OutputBatch *batch;
+  IndexBuffer functions;
+} FileSlice;
+
+// A large file parsed once, whose query runs over byte slices of its top
+// level on several workers. The parsing worker and the helper tasks it
+// queued for the others claim slices in turn; once all are done the parsing
+// worker merges their results in slice order and deletes the tree.
+struct SplitFile {
+  TSTree *tree;
+  Grammar *grammar;
+  const char *path;
+  const char *text;
+  // whether results are printed and kept
+  int32_t printing;
+  int32_t recording;
+  FileSlice *slices;
+  int32_t count;
+  atomic_int next;
+  // the parsing worker and every queued helper task hold a reference
+  atomic_int refs;
+  int32_t done;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+};
+
+void
+split_release(SplitFile *split)
+{
+  if (atomic_fetch_sub(&split->refs, 1) == 1) {
+    pthread_mutex_destroy(&split->lock);
+    pthread_cond_destroy(&split->finished);
+    free(split->slices);
+    free(split);
+  }
+}
+
+// Queries slices until none are left to claim. Helpers go through a copy of
+// the tree, as tree-sitter requires for use on another thread, and delete it
+// before the slice counts as done: the last reference to the tree's nodes
+// must be dropped by the parsing worker, whose arena they live in.
+void
+split_run(Worker *worker, SplitFile *split, int32_t helper)
+{
+  int32_t i;
+  while ((i = atomic_fetch_add(&split->next, 1)) < split->count) {
+    FileSlice *slice = &split->slices[i];
+    TSTree *tree = helper ? ts_tree_copy(split->tree) : split->tree;
+    slice->batch = split->printing ? output_batch_begin(&worker->output, NULL) : NULL;
+    query_range(worker, split->grammar, ts_tree_root_node(tree), split->path, split->text,
+                slice->start_byte, slice->end_byte, slice->batch,
+                split->recording ? &slice->functions : NULL);
+    if (helper) {
+      ts_tree_delete(tree);
+    }
+
+    pthread_mutex_lock(&split->lock);
+    if (++split->done == split->count) {
+      pthread_cond_signal(&split->finished);
+    }
+    pthread_mutex_unlock(&split->lock);
+  }
+}
+
+// Cuts the top level of a large file into slices of about equal size and
+// queries them on this and other workers; returns 0 when there is nothing
+// worth splitting.
+int32_t
+query_split(Worker *worker, OutputBatch *batch, Grammar *grammar, const char *path,
+            const SourceFile *src, TSTree *tree, int32_t recording)
+{
+  int32_t count = src->length / SPLIT_SLICE_MIN;
+  if (count > g_options.jobs) {
+    count = g_options.jobs;
+  }
+  if (count < 2) {
+    return 0;
+  }
+
+  FileSlice *slices = calloc(count, sizeof(FileSlice));
+  if (slices == NULL) {
+    fprintf(stderr, "err: could not allocate memory for file slices\n");
+    exit(1);
+  }
+
+  // a new slice starts at the first top-level node past each share of the file
+  uint32_t share = src->length / count;
+  int32_t n = 1;
+  TSTreeCursor cursor = ts_tree_cursor_new(ts_tree_root_node(tree));
+  if (ts_tree_cursor_goto_first_child(&cursor)) {
+    while (n < count && ts_tree_cursor_goto_next_sibling(&cursor)) {
+      uint32_t start = ts_node_start_byte(ts_tree_cursor_current_node(&cursor));
+      if (start >= (uint64_t)n * share) {
+        slices[n - 1].end_byte = start;
+        slices[n].start_byte = start;
+        n++;
+      }
+    }
+  }
+  ts_tree_cursor_delete(&cursor);
+  if (n < 2) {
+    free(slices);
+    return 0;
+  }
+  slices[n - 1].end_byte = UINT32_MAX;
+
+  SplitFile *split = calloc(1, sizeof(SplitFile));
+  if (split == NULL) {
+    fprintf(stderr, "err: could not allocate memory for file slices\n");
+    exit(1);
+  }
+  split->tree = tree;
+  split->grammar = grammar;
+  split->path = path;
+  split->text = src->data;
+  split->printing = batch != NULL;
+  split->recording = recording;
+  split->slices = slices;
+  split->count = n;
+  atomic_init(&split->next, 0);
+  atomic_init(&split->refs, n);
+  pthread_mutex_init(&split->lock, NULL);
+  pthread_cond_init(&split->finished, NULL);
+
+  for (int i = 1; i < n; i++) {
+    PathTask *helper = path_task_new(NULL, "", NULL, grammar);
+    helper->split = split;
+    scheduler_push_helper(worker->scheduler, (worker->id + i) % g_options.jobs, helper);
+  }
+
+  split_run(worker, split, 0);
+  pthread_mutex_lock(&split->lock);
+  while (split->done < split->count) {
+    pthread_cond_wait(&split->finished, &split->lock);
+  }
+  pthread_mutex_unlock(&split->lock);
+
+  for (int i = 0; i < n; i++) {
+    if (batch != NULL) {
+      output_batch_append(batch, slices[i].batch);
+    }
+    if (recording) {
+      index_buffer_append(&worker->functions, &slices[i].functions);
+      free(slices[i].functions.data);
+    }
+  }
+  worker->files_split++;
+  split_release(split);
+
+  return 1;
+}
+
+void
+process_file(Worker *worker, OutputBatch *batch, PathTask *file)
+{
+  const char *path = file->path;
+  Grammar *grammar = file->grammar;
+  const IndexEntry *cached = index_find(&g_index, path);
+  // unchanged files are answered without opening them
+  if (cached != NULL && file->has_stat
+      && file->size == cached->size
+      && file->mtime_sec == cached->mtime_sec
+      && file->mtime_nsec == cached->mtime_nsec) {
+    const char *functions = index_entry_functions(&g_index, cached);
+    output_cached_functions(batch, path, functions, cached->functions_length);
+    record_file(worker, path, cached->mtime_sec, cached->mtime_nsec, cached->size,
+                cached->hash, functions, cached->functions_length);
+    worker->files_cached++;
+    return;
+  }
+
+  double read_start = now_seconds();
+  SourceFile src;
+  if (!source_open(&src, path)) {
+    return;
+  }
+  double parse_start = now_seconds();
+  worker->read_seconds += parse_start - read_start;
+
+  // the index and --watch both keep every file's results
+  int32_t recording = (g_options.index_path != NULL || g_options.watch_path != NULL) && src.regular;
+  int32_t indexing = g_options.index_path != NULL && src.regular;
+  uint64_t hash = indexing ? index_hash(src.data, src.length) : 0;
+  if (indexing) {
+    worker->index_dirty = 1;
+  }
+
+  // touched but not modified, only the mtime needs updating
+  if (indexing && cached != NULL && cached->size == src.length && cached->hash == hash) {
+    const char *functions = index_entry_functions(&g_index, cached);
+    output_cached_functions(batch, path, functions, cached->functions_length);
+    record_file(worker, path, src.mtime_sec, src.mtime_nsec, src.length, hash,
+                functions, cached->functions_length);
+    worker->files_cached++;
+    source_close(&src);
+    return;
+  }
+  // counted here so a file answered from the index is not also counted as read
+  worker->files_read++;
+  worker->bytes_read += src.length;
+
+  arena_begin(&worker->arena);
+  if (ts_parser_language(worker->parser) != grammar->ts_language) {
+    ts_parser_set_language(worker->parser, grammar->ts_language);
+  }
+  TSInput input = { &src, source_read, TSInputEncodingUTF8 };
+  TSTree *tree = ts_parser_parse(worker->parser, NULL, input);
+  worker->parse_seconds += now_seconds() - parse_start;
+
+  // only --timeout stops a parse early
+  if (tree == NULL) {
+    fprintf(stderr, "err: skipping file that took longer than %" PRIu64 "ms to parse: %s\n",
+            g_options.timeout_ms, path);
+    worker->files_skipped++;
+    ts_parser_reset(worker->parser);
+    arena_end(&worker->arena);
+    source_close(&src);
+    return;
+  }
+
+  worker->functions.length = 0;
+  if (src.length < SPLIT_THRESHOLD
+      || !query_split(worker, batch, grammar, path, &src, tree, recording)) {
+    query_range(worker, grammar, ts_tree_root_node(tree), path, src.data, 0, UINT32_MAX,
+                batch, recording ? &worker->functions : NULL);
+  }
+
+  ts_tree_delete(tree);
+  ts_parser_reset(worker->parser);
+  arena_end(&worker->arena);
+
+  if (recording) {
+    char *functions = NULL;
+    if (worker->functions.length > 0) {
+      functions = malloc(worker->functions.length);
+      if (functions == NULL) {
+        fprintf(stderr, "err: could not allocate memory for index\n");
+        exit(1);
+      }
+      memcpy(functions, worker->functions.data, worker->functions.length);
+    }
+    record_file(worker, path, src.mtime_sec, src.mtime_nsec, src.length, hash,
+                functions, worker->functions.length);
+  }
+  source_close(&src);
+}
+
+void *
+process_files_async(void *arg)
+{
+  Worker *worker = (Worker *)arg;
+  Scheduler *scheduler = worker->scheduler;
+
+  arena_init(&worker->arena);
+  arena_bind(&worker->arena);
+  worker->parser = ts_parser_new();
+  worker->cursor = ts_query_cursor_new();
+  ts_parser_set_timeout_micros(worker->parser, g_options.timeout_ms * 1000);
+
+  PathTask *file;
+  double wait_start = now_seconds();
+  while ((file = scheduler_take(scheduler, worker->id)) != NULL) {
+    double file_start = now_seconds();
+    worker->wait_seconds += file_start - wait_start;
+
+    if (file->split != NULL) {
+      split_run(worker, file->split, 1);
+      split_release(file->split);
+    }
+    else {
+      // every file gets a batch, even an empty one, so --sorted output can move
+      // past it; --watch keeps the results instead of printing them
+      OutputBatch *batch = g_options.watch_path == NULL ? output_batch_begin(&worker->output, file->order) : NULL;
+      process_file(worker, batch, file);
+      if (batch != NULL) {
+        output_batch_submit(batch);
+      }
+    }
+
+    wait_start = now_seconds();
+    worker->busy_seconds += wait_start - file_start;
+    if (g_options.stats && file->split == NULL) {
+      record_latency(worker, wait_start - file_start);
+    }
+    free(file);
+    scheduler_done(scheduler);
+  }
+  worker->wait_seconds += now_seconds() - wait_start;
+
+  ts_query_cursor_delete(worker->cursor);
+  ts_parser_delete(worker->parser);
+  worker->arena_allocs = worker->arena.arena_allocs;
+  worker->heap_allocs = worker->arena.heap_allocs;
+  arena_destroy(&worker->arena);
+  free(worker->functions.data);
+
+  pthread_exit(NULL);
+}
+
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+} DirId;
+
+// Directories already walked, so following symlinks cannot loop forever.
+typedef struct {
+  DirId *data;
+  int32_t count;
+  int32_t size;
+  pthread_mutex_t lock;
+} VisitedDirs;
+
+typedef struct {
+  PathTask **data;
+  int32_t count;
+  int32_t size;
+  // directories queued or currently being read
+  int32_t outstanding;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} DirPool;
+
+typedef struct {
+  DirPool dirs;
+  VisitedDirs visited;
+  Scheduler scheduler;
+} Pipeline;
+
+uint32_t
+dir_id_hash(DirId id)
+{
+  uint64_t h = ((uint64_t)id.dev * 0x9e3779b97f4a7c15ull) ^ (uint64_t)id.ino;
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ull;
+  return (uint32_t)(h ^ (h >> 32));
+}
+
+void
+visited_insert_slot(DirId *data, int32_t size, DirId id)
+{
+  uint32_t i = dir_id_hash(id) & (size - 1);
+  while (data[i].ino != 0) {
+    i = (i + 1) & (size - 1);
+  }
+  data[i] = id;
+}
+
+// Returns 1 if the directory was not seen before.
+int32_t
+visited_add(VisitedDirs *v, DirId id)
+{
+  int32_t added = 1;
+  pthread_mutex_lock(&v->lock);
+  uint32_t i = dir_id_hash(id) & (v->size - 1);
+  while (v->data[i].ino != 0) {
+    if (v->data[i].ino == id.ino && v->data[i].dev == id.dev) {
+      added = 0;
+      break;
+    }
+    i = (i + 1) & (v->size - 1);
+  }
+
+  if (added) {
+    v->data[i] = id;
+    v->count++;
+    if (v->count * 2 > v->size) {
+      int32_t size = v->size * 2;
+      DirId *data = calloc(size, sizeof(DirId));
+      if (data == NULL) {
+        fprintf(stderr, "err: could not allocate memory for directories\n");
+        exit(1);
+      }
+      for (int j = 0; j < v->size; j++) {
+        if (v->data[j].ino != 0) {
+          visited_insert_slot(data, size, v->data[j]);
+        }
+      }
+      free(v->data);
+      v->data = data;
+      v->size = size;
+    }
+  }
+  pthread_mutex_unlock(&v->lock);
+
+  return added;
+}
+
+void
+push_dir(DirPool *pool, PathTask *dir)
+{
+  pthread_mutex_lock(&pool->lock);
+  if (pool->count + 1 > pool->size) {
+    pool->size *= 2;
+    pool->data = realloc(pool->data, pool->size * sizeof(PathTask *));
+    if (pool->data == NULL) {
+      fprintf(stderr, "err: could not allocate memory for directories\n");
+      exit(1);
+    }
+  }
+  pool->data[pool->count++] = dir;
+  pool->outstanding++;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Returns NULL once no directory is queued and none is being read, as
+// nothing can add more work after that.
+PathTask *
+take_dir(DirPool *pool)
+{
+  PathTask *dir = NULL;
+  pthread_mutex_lock(&pool->lock);
+  while (pool->count == 0 && pool->outstanding > 0) {
+    pthread_cond_wait(&pool->cond, &pool->lock);
+  }
+  if (pool->count > 0) {
+    dir = pool->data[--pool->count];
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return dir;
+}
+
+void
+finish_dir(DirPool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  if (--pool->outstanding == 0) {
+    pthread_cond_broadcast(&pool->cond);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+int32_t
+is_excluded(const char *dir_path, const char *name)
+{
+  for (int i = 0; i < g_options.excludes_count; i++) {
+    const char *pattern = g_options.excludes[i];
+    if (strchr(pattern, '/') != NULL) {
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s/%s", dir_path, name);
+      if (fnmatch(pattern, path, 0) == 0) {
+        return 1;
+      }
+    }
+    else if (fnmatch(pattern, name, 0) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+Grammar *
+grammar_for_file(const char *name)
+{
+  const char *ext = strrchr(name, '.');
+  if (ext == NULL) {
+    return NULL;
+  }
+
+  for (int i = 0; i < GRAMMARS_COUNT; i++) {
+    for (const char **e = g_grammars[i].extensions; *e != NULL; e++) {
+      if (strcmp(ext, *e) == 0) {
+        return &g_grammars[i];
+      }
+    }
+  }
+
+  return NULL;
+}
+
+// --watch reparses changed files on the main thread with its own parser
+Worker g_watch_worker;
+
+TSTree *
+watch_parse(const char *path, const char *text, uint32_t length, TSTree *old_tree,
+            IndexBuffer *functions)
+{
+  Worker *worker = &g_watch_worker;
+  const char *name = strrchr(path, '/');
+  Grammar *grammar = grammar_for_file(name != NULL ? name + 1 : path);
+  if (grammar == NULL) {
+    return NULL;
+  }
+  if (g_options.max_size > 0 && length > g_options.max_size) {
+    fprintf(stderr, "err: skipping file larger than %" PRIu64 " bytes: %s\n",
+            g_options.max_size, path);
+    return NULL;
+  }
+
+  if (ts_parser_language(worker->parser) != grammar->ts_language) {
+    ts_parser_set_language(worker->parser, grammar->ts_language);
+  }
+  TSTree *tree = ts_parser_parse_string(worker->parser, old_tree, text, length);
+  if (tree == NULL) {
+    fprintf(stderr, "err: skipping file that took longer than %" PRIu64 "ms to parse: %s\n",
+            g_options.timeout_ms, path);
+    ts_parser_reset(worker->parser);
+    return NULL;
+  }
+
+  query_range(worker, grammar, ts_tree_root_node(tree), path, text, 0, UINT32_MAX,
+              NULL, functions);
+  return tree;
+}
+
+int32_t
+watch_accept(const char *dir_path, const char *name, int32_t is_dir)
+{
+  return !is_excluded(dir_path, name) && (is_dir || grammar_for_file(name) != NULL);
+}
+
+typedef struct {
+  const char *name;
+  uint32_t name_offset;
+  int32_t is_dir;
+  Grammar *grammar;
+  // regular files only
+  int32_t has_stat;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} DirEntry;
+
+// Per-walker scratch space for the entries of the directory being read.
+typedef struct {
+  Pipeline *pipeline;
+  DirEntry *entries;
+  int32_t entries_count;
+  int32_t entries_size;
+  int32_t *is_dir;
+  char *names;
+  uint32_t names_length;
+  uint32_t names_size;
+  // --stats: reading directories, waiting for one to read, and waiting for
+  // room in a full file queue
+  double traverse_seconds;
+  double idle_seconds;
+  double blocked_seconds;
+  uint64_t files_skipped;
+} Walker;
+
+// `st` is NULL for directories and for files that could not be stat'ed.
+void
+walker_add_entry(Walker *walker, const char *name, int32_t is_dir, Grammar *grammar, const struct stat *st)
+{
+  if (walker->entries_count + 1 > walker->entries_size) {
+    walker->entries_size = walker->entries_size > 0 ? walker->entries_size * 2 : 64;
+    walker->entries = realloc(walker->entries, walker->entries_size * sizeof(DirEntry));
+    walker->is_dir = realloc(walker->is_dir, walker->entries_size * sizeof(int32_t));
+    if (walker->entries == NULL || walker->is_dir == NULL) {
+      fprintf(stderr, "err: could not allocate memory for directories\n");
+      exit(1);
+    }
+  }
+
+  uint32_t name_length = strlen(name) + 1;
+  if (walker->names_length + name_length > walker->names_size) {
+    while (walker->names_length + name_length > walker->names_size) {
+      walker->names_size = walker->names_size > 0 ? walker->names_size * 2 : 4096;
+    }
+    walker->names = realloc(walker->names, walker->names_size);
+    if (walker->names == NULL) {
+      fprintf(stderr, "err: could not allocate memory for directories\n");
+      exit(1);
+    }
+  }
+
+  memcpy(walker->names + walker->names_length, name, name_length);
+  DirEntry *entry = &walker->entries[walker->entries_count++];
+  *entry = (DirEntry){ NULL, walker->names_length, is_dir, grammar, 0, 0, 0, 0 };
+  if (st != NULL && S_ISREG(st->st_mode)) {
+    entry->has_stat = 1;
+    entry->size = st->st_size;
+    entry->mtime_sec = st->st_mtim.tv_sec;
+    entry->mtime_nsec = st->st_mtim.tv_nsec;
+  }
+  walker->names_length += name_length;
+}
+
+int
+compare_dir_entries(const void *a, const void *b)
+{
+  const DirEntry *ea = a;
+  const DirEntry *eb = b;
+  return order_compare_names(ea->name, ea->is_dir, eb->name, eb->is_dir);
+}
+
+void
+read_dir_entries(Walker *walker, const char *path)
+{
+  int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd < 0) {
+    fprintf(stderr, "err: could not open directory: %s\n", path);
+    return;
+  }
+
+  if (g_options.follow_symlinks) {
+    struct stat st;
+    if (fstat(dirfd, &st) != 0 || !visited_add(&walker->pipeline->visited, (DirId){ st.st_dev, st.st_ino })) {
+      close(dirfd);
+      return;
+    }
+  }
+
+  // watched before it is read, so files created meanwhile are not missed
+  if (g_options.watch_path != NULL) {
+    watch_add_dir(path);
+  }
+
+  DIR *dir = fdopendir(dirfd);
+  if (dir == NULL) {
+    fprintf(stderr, "err: could not open directory: %s\n", path);
+    close(dirfd);
+    return;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    if (is_excluded(path, entry->d_name)) {
+      continue;
+    }
+
+    unsigned char type = entry->d_type;
+    struct stat st;
+    int32_t has_stat = 0;
+    if (type == DT_UNKNOWN || (type == DT_LNK && g_options.follow_symlinks)) {
+      int flags = g_options.follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW;
+      if (fstatat(dirfd, entry->d_name, &st, flags) != 0) {
+        continue;
+      }
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+      has_stat = type != DT_LNK;
+    }
+
+    if (type == DT_DIR) {
+      walker_add_entry(walker, entry->d_name, 1, NULL, NULL);
+      continue;
+    }
+
+    Grammar *grammar = grammar_for_file(entry->d_name);
+    if (grammar == NULL) {
+      continue;
+    }
+
+    // the size orders the file queue, and with the mtime spares the index a stat
+    if (!has_stat) {
+      has_stat = fstatat(dirfd, entry->d_name, &st, 0) == 0;
+    }
+    if (has_stat && g_options.max_size > 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size > g_options.max_size) {
+      fprintf(stderr, "err: skipping file larger than %" PRIu64 " bytes: %s/%s\n",
+              g_options.max_size, path, entry->d_name);
+      walker->files_skipped++;
+      continue;
+    }
+    walker_add_entry(walker, entry->d_name, 0, grammar, has_stat ? &st : NULL);
+  }
+
+  closedir(dir);
+}
+
+void
+walk_dir(Walker *walker, PathTask *dir)
+{
+  Pipeline *pipeline = walker->pipeline;
+  walker->entries_count = 0;
+  walker->names_length = 0;
+  read_dir_entries(walker, dir->path);
+
+  int32_t count = walker->entries_count;
+  for (int i = 0; i < count; i++) {
+    walker->entries[i].name = walker->names + walker->entries[i].name_offset;
+  }
+
+  OrderNode *children = NULL;
+  if (dir->order != NULL) {
+    if (count > 0) {
+      qsort(walker->entries, count, sizeof(DirEntry), compare_dir_entries);
+    }
+    for (int i = 0; i < count; i++) {
+      walker->is_dir[i] = walker->entries[i].is_dir;
+    }
+    children = order_children(dir->order, walker->is_dir, count);
+  }
+
+  for (int i = 0; i < count; i++) {
+    DirEntry *entry = &walker->entries[i];
+    OrderNode *order = children != NULL ? &children[i] : NULL;
+    PathTask *task = path_task_new(dir->path, entry->name, order, entry->grammar);
+    task->has_stat = entry->has_stat;
+    task->size = entry->size;
+    task->mtime_sec = entry->mtime_sec;
+    task->mtime_nsec = entry->mtime_nsec;
+    if (entry->is_dir) {
+      push_dir(&pipeline->dirs, task);
+    }
+    else {
+      walker->blocked_seconds += scheduler_push(&pipeline->scheduler, task);
+    }
+  }
+
+  if (dir->order != NULL) {
+    order_publish(dir->order);
+  }
+}
+
+void *
+walk_dirs_async(void *arg)
+{
+  Walker *walker = (Walker *)arg;
+
+  PathTask *dir;
+  double idle_start = now_seconds();
+  while ((dir = take_dir(&walker->pipeline->dirs)) != NULL) {
+    double walk_start = now_seconds();
+    walker->idle_seconds += walk_start - idle_start;
+    double blocked = walker->blocked_seconds;
+
+    walk_dir(walker, dir);
+    free(dir);
+    finish_dir(&walker->pipeline->dirs);
+
+    idle_start = now_seconds();
+    walker->traverse_seconds += idle_start - walk_start - (walker->blocked_seconds - blocked);
+  }
+  walker->idle_seconds += now_seconds() - idle_start;
+
+  free(walker->entries);
+  free(walker->is_dir);
+  free(walker->names);
+
+  pthread_exit(NULL);
+}
+
+void
+write_index(Worker *workers, int32_t count)
+{
+  int32_t total = 0;
+  int32_t dirty = 0;
+  for (int i = 0; i < count; i++) {
+    total += workers[i].records_count;
+    dirty |= workers[i].index_dirty;
+  }
+
+  // files appeared or disappeared since the index was written
+  if (g_index.header == NULL || total != (int32_t)g_index.header->count) {
+    dirty = 1;
+  }
+
+  if (dirty) {
+    IndexRecord *records = calloc(total > 0 ? total : 1, sizeof(IndexRecord));
+    if (records == NULL) {
+      fprintf(stderr, "err: could not allocate memory for index\n");
+      exit(1);
+    }
+    int32_t n = 0;
+    for (int i = 0; i < count; i++) {
+      memcpy(&records[n], workers[i].records, workers[i].records_count * sizeof(IndexRecord));
+      n += workers[i].records_count;
+    }
+    if (!index_write(g_options.index_path, g_queries_hash, records, total)) {
+      fprintf(stderr, "err: could not write index: %s\n", g_options.index_path);
+    }
+    free(records);
+  }
+}
+
+void
+free_records(Worker *workers, int32_t count)
+{
+  for (int i = 0; i < count; i++) {
+    for (int j = 0; j < workers[i].records_count; j++) {
+      IndexRecord *r = &workers[i].records[j];
+      free((char *)r->path);
+      if (!is_index_memory(r->functions)) {
+        free((char *)r->functions);
+      }
+    }
+    free(workers[i].records);
+  }
+}
+
+int
+compare_doubles(const void *a, const void *b)
+{
+  double da = *(const double *)a;
+  double db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+double
+percentile(const double *sorted, int32_t count, double p)
+{
+  if (count == 0) {
+    return 0;
+  }
+
+  int32_t rank = (int32_t)(p * count + 0.999999);
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+double
+share(double part, double total)
+{
+  return total > 0 ? 100 * part / total : 0;
+}
+
+void
+print_stats(Worker *workers, Walker *walkers, int32_t count, double wall_seconds)
+{
+  uint64_t files = 0;
+  uint64_t cached = 0;
+  uint64_t bytes = 0;
+  uint64_t arena_allocs = 0;
+  uint64_t heap_allocs = 0;
+  int32_t latencies_count = 0;
+  double read_seconds = 0;
+  double parse_seconds = 0;
+  double query_seconds = 0;
+  double busy_seconds = 0;
+  double wait_seconds = 0;
+  double traverse_seconds = 0;
+  double idle_seconds = 0;
+  double blocked_seconds = 0;
+  uint64_t too_large = 0;
+  uint64_t timed_out = 0;
+  uint64_t split = 0;
+  for (int i = 0; i < count; i++) {
+    files += workers[i].files_read;
+    cached += workers[i].files_cached;
+    bytes += workers[i].bytes_read;
+    arena_allocs += workers[i].arena_allocs;
+    heap_allocs += workers[i].heap_allocs;
+    latencies_count += workers[i].latencies_count;
+    read_seconds += workers[i].read_seconds;
+    parse_seconds += workers[i].parse_seconds;
+    query_seconds += workers[i].query_seconds;
+    busy_seconds += workers[i].busy_seconds;
+    wait_seconds += workers[i].wait_seconds;
+    traverse_seconds += walkers[i].traverse_seconds;
+    idle_seconds += walkers[i].idle_seconds;
+    blocked_seconds += walkers[i].blocked_seconds;
+    too_large += walkers[i].files_skipped;
+    timed_out += workers[i].files_skipped;
+    split += workers[i].files_split;
+  }
+
+  double *latencies = calloc(latencies_count > 0 ? latencies_count : 1, sizeof(double));
+  if (latencies == NULL) {
+    fprintf(stderr, "err: could not allocate memory for stats\n");
+    exit(1);
+  }
+  int32_t n = 0;
+  for (int i = 0; i < count; i++) {
+    memcpy(&latencies[n], workers[i].latencies, workers[i].latencies_count * sizeof(double));
+    n += workers[i].latencies_count;
+    free(workers[i].latencies);
+  }
+  if (n > 0) {
+    qsort(latencies, n, sizeof(double), compare_doubles);
+  }
+
+  OutputStats output;
+  output_stats(&output);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  double mb = bytes / (1024.0 * 1024.0);
+  uint64_t total = files + cached;
+  fprintf(stderr, "files: %" PRIu64 " (%" PRIu64 " from index), bytes: %" PRIu64 ", wall: %.3fs\n",
+          total, cached, bytes, wall_seconds);
+  fprintf(stderr, "throughput: %.1f files/s, %.1f MB/s\n",
+          wall_seconds > 0 ? total / wall_seconds : 0, wall_seconds > 0 ? mb / wall_seconds : 0);
+  fprintf(stderr, "latency per file: p50 %.3fms, p99 %.3fms, max %.3fms\n",
+          percentile(latencies, n, 0.50) * 1e3, percentile(latencies, n, 0.99) * 1e3,
+          n > 0 ? latencies[n - 1] * 1e3 : 0);
+  fprintf(stderr, "peak rss: %.1f MB\n", usage.ru_maxrss / 1024.0);
+  fprintf(stderr, "stages (thread time): traverse %.3fs, read %.3fs, parse %.3fs, query %.3fs, output %.3fs\n",
+          traverse_seconds, read_seconds, parse_seconds, query_seconds, output.write_seconds);
+
+  // walkers blocked on a full queue mean the workers cannot keep up, workers
+  // waiting on an empty one mean the walkers cannot
+  double walker_seconds = traverse_seconds + idle_seconds + blocked_seconds;
+  double worker_seconds = busy_seconds + wait_seconds;
+  fprintf(stderr, "walkers: %.0f%% busy, %.0f%% idle waiting for directories, %.0f%% blocked on a full file queue\n",
+          share(traverse_seconds, walker_seconds), share(idle_seconds, walker_seconds),
+          share(blocked_seconds, walker_seconds));
+  fprintf(stderr, "workers: %.0f%% busy, %.0f%% waiting on the file queue\n",
+          share(busy_seconds, worker_seconds), share(wait_seconds, worker_seconds));
+  for (int i = 0; i < count; i++) {
+    fprintf(stderr, "  walker %d: traverse %.3fs, idle %.3fs, blocked %.3fs\n",
+            i, walkers[i].traverse_seconds, walkers[i].idle_seconds, walkers[i].blocked_seconds);
+  }
+  for (int i = 0; i < count; i++) {
+    Worker *w = &workers[i];
+    fprintf(stderr, "  worker %d: %" PRIu64 " files, read %.3fs, parse %.3fs, query %.3fs, queue wait %.3fs\n",
+            i, w->files_read + w->files_cached, w->read_seconds, w->parse_seconds,
+            w->query_seconds, w->wait_seconds);
+  }
+  fprintf(stderr, "  writer: %.1f MB, write %.3fs, idle %.3fs\n",
+          output.bytes / (1024.0 * 1024.0), output.write_seconds, output.idle_seconds);
+
+  if (split > 0) {
+    fprintf(stderr, "split: %" PRIu64 " large files queried in slices by several workers\n", split);
+  }
+  if (too_large > 0 || timed_out > 0) {
+    fprintf(stderr, "skipped: %" PRIu64 " files over --max-size, %" PRIu64 " over --timeout\n",
+            too_large, timed_out);
+  }
+  if (g_options.index_path != NULL) {
+    fprintf(stderr, "index: %" PRIu64 " files served from index\n", cached);
+  }
+  if (files > 0) {
+    fprintf(stderr, "tree-sitter allocations per file: %.1f from arena, %.1f from heap\n",
+            (double)arena_allocs / files, (double)heap_allocs / files);
+  }
+  free(latencies);
+}
 
 char *
-get_node_text(TSNode node, char *source, uint32_t *contents_length)
+read_text_file(const char *path, uint32_t *length)
 {
-  uint32_t start = ts_node_start_byte(node);
-  uint32_t end = ts_node_end_byte(node);
-  *contents_length = end - start + 1;
-  char *contents = calloc(1, *contents_length);
-  if (contents != NULL) {
-    strncpy(contents, &source[start], *contents_length - 1);
+  SourceFile src;
+  if (!source_open(&src, path)) {
+    exit(1);
   }
 
-  return contents;
+  char *text = malloc(src.length + 1);
+  if (text == NULL) {
+    fprintf(stderr, "err: could not allocate memory to read the file %s\n", path);
+    exit(1);
+  }
+  memcpy(text, src.data, src.length);
+  text[src.length] = '\0';
+  *length = src.length;
+  source_close(&src);
+
+  return text;
+}
+
+// The query file, of the `count` joined at `starts`, that holds `offset`.
+int32_t
+query_file_at(const uint32_t *starts, int32_t count, uint32_t offset)
+{
+  int32_t file = 0;
+  while (file + 1 < count && starts[file + 1] <= offset) {
+    file++;
+  }
+  return file;
 }
 
+// Compiles the predicates of every pattern in `grammar`'s query, and exits
+// on any this tool does not evaluate.
 void
-process_file(char *contents)
+load_predicates(Grammar *grammar, const char **paths, const uint32_t *starts, int32_t count)
 {
-  TSParser *tsparser = ts_parser_new();
-  ts_parser_set_language(tsparser, tree_sitter_c());
-  TSTree *tree = ts_parser_parse_string(tsparser, NULL, contents, strlen(contents));
-  TSNode root = ts_tree_root_node(tree);
+  const TSQuery *query = grammar->query;
+  uint32_t patterns = ts_query_pattern_count(query);
+  grammar->pattern_predicates = calloc(patterns + 1, sizeof(uint32_t));
+  if (grammar->pattern_predicates == NULL) {
+    exit(1);
+  }
+
+  uint32_t total = 0;
+  for (uint32_t p = 0; p < patterns; p++) {
+    uint32_t steps_count;
+    const TSQueryPredicateStep *steps = ts_query_predicates_for_pattern(query, p, &steps_count);
+    for (uint32_t i = 0; i < steps_count; i++) {
+      total += steps[i].type == TSQueryPredicateStepTypeDone;
+    }
+  }
+  grammar->predicates = calloc(total > 0 ? total : 1, sizeof(QueryPredicate));
+  if (grammar->predicates == NULL) {
+    exit(1);
+  }
 
-  TSQueryCursor *cursor = ts_query_cursor_new();
-  ts_query_cursor_exec(cursor, g_query, root);
+  uint32_t n = 0;
+  for (uint32_t p = 0; p < patterns; p++) {
+    grammar->pattern_predicates[p] = n;
+    uint32_t steps_count;
+    const TSQueryPredicateStep *steps = ts_query_predicates_for_pattern(query, p, &steps_count);
+    for (uint32_t i = 0; i < steps_count; ) {
+      uint32_t args = 0;
+      while (steps[i + 1 + args].type != TSQueryPredicateStepTypeDone) {
+        args++;
+      }
 
-  TSQueryMatch match;
-  while(ts_query_cursor_next_match(cursor, &match)) {
-    for (int i = 0; i < match.capture_count; i++) {
-      TSNode node = match.captures[i].node;
+      uint32_t name_length;
+      const char *name = ts_query_string_value_for_id(query, steps[i].value_id, &name_length);
+      const TSQueryPredicateStep *arg = &steps[i + 1];
+      QueryPredicate *predicate = &grammar->predicates[n];
+      predicate->negated = name_length > 4 && memcmp(name, "not-", 4) == 0;
+      const char *op = predicate->negated ? name + 4 : name;
+      uint32_t op_length = predicate->negated ? name_length - 4 : name_length;
+      predicate->is_match = op_length == 6 && memcmp(op, "match?", 6) == 0;
+      int32_t is_eq = op_length == 3 && memcmp(op, "eq?", 3) == 0;
 
-      TSNode type = ts_node_child_by_field_id(node, TS_C_field_type);
-      uint32_t type_text_length;
-      char *type_text = get_node_text(type, contents, &type_text_length);
-      if (type_text != NULL) {
-        printf("type: %s\n", type_text);
+      int32_t file = query_file_at(starts, count, ts_query_start_byte_for_pattern(query, p));
+      const char *query_path = count > 0 ? paths[file] : "built-in query";
+      if ((!is_eq && !predicate->is_match) || args != 2
+          || steps[i].type != TSQueryPredicateStepTypeString
+          || arg[0].type != TSQueryPredicateStepTypeCapture
+          || (predicate->is_match && arg[1].type != TSQueryPredicateStepTypeString)) {
+        fprintf(stderr, "err: unsupported predicate #%.*s in %s; only #eq?, #match? "
+                "and their #not- forms on a capture are evaluated\n",
+                (int)name_length, name, query_path);
+        exit(1);
       }
 
-      TSNode declarator = ts_node_child_by_field_id(node, TS_C_field_declarator);
-      uint32_t declarator_text_length;
-      char *declarator_text = get_node_text(declarator, contents, &declarator_text_length);
-      if (declarator_text != NULL) {
-        printf("declarator: %s\n\n", declarator_text);
+      predicate->capture = arg[0].value_id;
+      predicate->other = -1;
+      if (arg[1].type == TSQueryPredicateStepTypeCapture) {
+        predicate->other = arg[1].value_id;
+      }
+      else {
+        predicate->string = ts_query_string_value_for_id(query, arg[1].value_id,
+                                                         &predicate->string_length);
+      }
+      if (predicate->is_match
+          && regcomp(&predicate->regex, predicate->string, REG_EXTENDED | REG_NOSUB) != 0) {
+        fprintf(stderr, "err: invalid #%.*s pattern in %s: %s\n",
+                (int)name_length, name, query_path, predicate->string);
+        exit(1);
       }
 
-      free(type_text);
-      free(declarator_text);
+      n++;
+      i += args + 2;
     }
   }
+  grammar->pattern_predicates[patterns] = n;
+}
 
-  ts_tree_delete(tree);
-  ts_parser_delete(tsparser);
+void
+free_predicates(Grammar *grammar)
+{
+  uint32_t count = grammar->pattern_predicates[ts_query_pattern_count(grammar->query)];
+  for (uint32_t i = 0; i < count; i++) {
+    if (grammar->predicates[i].is_match) {
+      regfree(&grammar->predicates[i].regex);
+    }
+  }
+  free(grammar->predicates);
+  free(grammar->pattern_predicates);
 }
 
-typedef struct {
-  char **data;
-  int32_t count;
-  int32_t size;
-  pthread_mutex_t lock;
-} FilesCollection;
+// The grammar a -q argument is for: named by a "lang:" prefix, else by the
+// directory holding the file (queries/<lang>/...), else the only grammar
+// there is. Sets `path` to the file itself.
+Grammar *
+query_grammar(const char *arg, const char **path)
+{
+  *path = arg;
+  const char *colon = strchr(arg, ':');
+  for (int g = 0; colon != NULL && g < GRAMMARS_COUNT; g++) {
+    size_t name_length = strlen(g_grammars[g].name);
+    if ((size_t)(colon - arg) == name_length && memcmp(arg, g_grammars[g].name, name_length) == 0) {
+      *path = colon + 1;
+      return &g_grammars[g];
+    }
+  }
 
+  const char *slash = strrchr(arg, '/');
+  if (slash != NULL) {
+    const char *dir = slash;
+    while (dir > arg && dir[-1] != '/') {
+      dir--;
+    }
+    for (int g = 0; g < GRAMMARS_COUNT; g++) {
+      size_t name_length = strlen(g_grammars[g].name);
+      if ((size_t)(slash - dir) == name_length && memcmp(dir, g_grammars[g].name, name_length) == 0) {
+        return &g_grammars[g];
+      }
+    }
+  }
+
+  return GRAMMARS_COUNT == 1 ? &g_grammars[0] : NULL;
+}
+
+// Joins the query files of each grammar into one source so a single cursor
+// pass per tree runs all of them, then compiles it for that grammar alone.
 void
-push_file(FilesCollection *fc, char *path)
+load_queries(void)
 {
-  pthread_mutex_lock(&fc->lock);
-  if (fc->count + 1 > fc->size) {
-    fc->size *= 2;
-    fc->data = realloc(fc->data, fc->size * sizeof(char *));
-    if (fc->data == NULL) {
+  int32_t count = g_options.queries_count;
+  Grammar **grammars = calloc(count > 0 ? count : 1, sizeof(Grammar *));
+  const char **paths = calloc(count > 0 ? count : 1, sizeof(char *));
+  const char **grammar_paths = calloc(count > 0 ? count : 1, sizeof(char *));
+  uint32_t *starts = calloc(count > 0 ? count : 1, sizeof(uint32_t));
+  if (grammars == NULL || paths == NULL || grammar_paths == NULL || starts == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < count; i++) {
+    grammars[i] = query_grammar(g_options.queries[i], &paths[i]);
+    if (grammars[i] == NULL) {
+      fprintf(stderr, "err: cannot tell which language %s is for, name it as <language>:%s "
+              "or keep it in queries/<language>/\n", g_options.queries[i], g_options.queries[i]);
+      exit(1);
+    }
+  }
+
+  g_queries_hash = 0;
+  for (int g = 0; g < GRAMMARS_COUNT; g++) {
+    Grammar *grammar = &g_grammars[g];
+    grammar->ts_language = grammar->language();
+
+    char *source = NULL;
+    uint32_t length = 0;
+    int32_t files = 0;
+    for (int i = 0; i < count; i++) {
+      if (grammars[i] != grammar) {
+        continue;
+      }
+      uint32_t file_length;
+      char *text = read_text_file(paths[i], &file_length);
+      source = realloc(source, length + file_length + 2);
+      if (source == NULL) {
+        fprintf(stderr, "err: could not allocate memory for queries\n");
+        exit(1);
+      }
+      grammar_paths[files] = paths[i];
+      starts[files++] = length;
+      memcpy(source + length, text, file_length);
+      length += file_length;
+      source[length++] = '\n';
+      source[length] = '\0';
+      free(text);
+    }
+    if (files == 0) {
+      source = strdup(grammar->default_query);
+      if (source == NULL) {
+        exit(1);
+      }
+      length = strlen(source);
+    }
+
+    uint32_t error_offset;
+    TSQueryError error_type;
+    grammar->query = ts_query_new(grammar->ts_language, source, length, &error_offset, &error_type);
+    if (grammar->query == NULL) {
+      int32_t file = query_file_at(starts, files, error_offset);
+      const char *query_path = files > 0 ? grammar_paths[file] : "built-in query";
+      uint32_t offset = files > 0 ? error_offset - starts[file] : error_offset;
+      fprintf(stderr, "err: invalid %s query in %s at offset %u\n", grammar->name, query_path, offset);
+      exit(1);
+    }
+
+    uint32_t captures = ts_query_capture_count(grammar->query);
+    grammar->roles = calloc(captures > 0 ? captures : 1, sizeof(CaptureRole));
+    if (grammar->roles == NULL) {
       exit(1);
     }
+    for (uint32_t i = 0; i < captures; i++) {
+      uint32_t name_length;
+      const char *name = ts_query_capture_name_for_id(grammar->query, i, &name_length);
+      if (name_length == 4 && memcmp(name, "type", 4) == 0) {
+        grammar->roles[i] = CAPTURE_TYPE;
+      }
+      else if (name_length == 4 && memcmp(name, "name", 4) == 0) {
+        grammar->roles[i] = CAPTURE_NAME;
+      }
+      else if (name_length > 0 && name[0] == '_') {
+        grammar->roles[i] = CAPTURE_HIDDEN;
+      }
+      else {
+        grammar->roles[i] = CAPTURE_ITEM;
+      }
+    }
+    load_predicates(grammar, grammar_paths, starts, files);
+
+    grammar->type_field = ts_language_field_id_for_name(grammar->ts_language, "type", 4);
+    grammar->declarator_field = ts_language_field_id_for_name(grammar->ts_language, "declarator", 10);
+
+    // the index is only valid for the same queries on every grammar
+    g_queries_hash = g_queries_hash * 0x100000001b3ull ^ index_hash(source, length);
+    free(source);
   }
-  fc->data[fc->count++] = path;
-  pthread_mutex_unlock(&fc->lock);
+
+  free(grammars);
+  free(paths);
+  free(grammar_paths);
+  free(starts);
 }
 
-char *
-pop_file(FilesCollection *fc)
+// Reads a byte count with an optional k, m or g suffix.
+int32_t
+parse_size(const char *text, uint64_t *size)
 {
-  pthread_mutex_lock(&fc->lock);
-  char *data = NULL;
-  if (fc->count > 0) {
-    data = fc->data[--fc->count];
+  // strtoull would negate "-1" into a huge size
+  if (*text == '-') {
+    return 0;
   }
-  pthread_mutex_unlock(&fc->lock);
 
-  return data;
+  char *end;
+  errno = 0;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (end == text || errno == ERANGE) {
+    return 0;
+  }
+
+  int32_t shift = 0;
+  switch (*end) {
+  case 'k': case 'K':
+    shift = 10;
+    end++;
+    break;
+  case 'm': case 'M':
+    shift = 20;
+    end++;
+    break;
+  case 'g': case 'G':
+    shift = 30;
+    end++;
+    break;
+  }
+  if (*end != '\0' || value > (UINT64_MAX >> shift)) {
+    return 0;
+  }
+
+  *size = (uint64_t)value << shift;
+  return 1;
 }
 
-void *
-process_files_async(void *arg)
+// Milliseconds, small enough to pass to tree-sitter in microseconds.
+int32_t
+parse_timeout(const char *text, uint64_t *ms)
 {
-  FilesCollection *files = (FilesCollection *)arg;
+  if (*text == '-') {
+    return 0;
+  }
 
-  while (g_running) {
-    char *path = pop_file(files);
-    if (path != NULL) {
-      process_file(path);
-      free(path);
-    }
+  char *end;
+  errno = 0;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (end == text || *end != '\0' || errno == ERANGE || value > UINT64_MAX / 1000) {
+    return 0;
   }
 
-  pthread_exit(NULL);
+  *ms = value;
+  return 1;
+}
+
+void
+print_usage(const char *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [options] [path]...\n"
+          "  -j, --jobs threads    number of walker and parser threads (default: online CPUs)\n"
+          "  -x, --exclude glob    skip entries whose name matches glob, or whose path does\n"
+          "                        if glob contains a '/'; may be repeated (e.g. -x .git -x vendor)\n"
+          "  -L, --follow          follow symbolic links to directories\n"
+          "  -s, --stats           print throughput, per-file latency and where each thread\n"
+          "                        spent its time to stderr\n"
+          "  -i, --index file      reuse and update results cached in file (e.g. .ls-funcs.idx)\n"
+          "  -f, --format format   text (default), loc (path:line:col), jsonl or binary\n"
+          "  -q, --query [lang:]file\n"
+          "                        extract what the tree-sitter query in file captures for\n"
+          "                        lang, or the language named by the file's directory;\n"
+          "                        may be repeated (default: function definitions, see queries/);\n"
+          "                        captures starting with '_' are not reported\n"
+          "      --sorted          print files in path order\n"
+          "      --max-size bytes  skip and report files larger than bytes (k, m, g suffixes)\n"
+          "      --timeout ms      skip and report files that take longer than ms to parse\n"
+          "      --watch socket    keep results in memory, follow changes and answer\n"
+          "                        queries on the Unix socket (see watch.h)\n",
+          argv0);
 }
 
 int
 main(int argc, char *argv[])
 {
-  uint32_t error_offset;
-  TSQueryError errorType;
-  char *query_text = "((function_definition) @func)";
-  g_query = ts_query_new(tree_sitter_c(), query_text, strlen(query_text), &error_offset, &errorType);
-  if (errorType != TSQueryErrorNone) {
-    exit(1);
+  g_options.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (g_options.jobs < 1) {
+    g_options.jobs = 1;
   }
-
-  int32_t dirs_size = 192;
-  int32_t dirs_count = 0;
-  char **dirs = calloc(1, dirs_size * sizeof(char*));
-  if (dirs == NULL) {
+  g_options.excludes = calloc(argc, sizeof(char *));
+  g_options.queries = calloc(argc, sizeof(char *));
+  if (g_options.excludes == NULL || g_options.queries == NULL) {
     exit(1);
   }
-  dirs[dirs_count++] = strdup(".");
 
-  FilesCollection files;
-  files.count = 0;
-  files.size = 256;
-  files.data = calloc(1, files.size * sizeof(char*));
-  if (files.data == NULL) {
-    exit(1);
+  static const struct option long_options[] = {
+    { "jobs", required_argument, NULL, 'j' },
+    { "exclude", required_argument, NULL, 'x' },
+    { "follow", no_argument, NULL, 'L' },
+    { "stats", no_argument, NULL, 's' },
+    { "index", required_argument, NULL, 'i' },
+    { "format", required_argument, NULL, 'f' },
+    { "query", required_argument, NULL, 'q' },
+    { "sorted", no_argument, NULL, OPTION_SORTED },
+    { "max-size", required_argument, NULL, OPTION_MAX_SIZE },
+    { "timeout", required_argument, NULL, OPTION_TIMEOUT },
+    { "watch", required_argument, NULL, OPTION_WATCH },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 },
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "j:x:Lsi:f:q:h", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'j':
+      g_options.jobs = atoi(optarg);
+      if (g_options.jobs < 1) {
+        fprintf(stderr, "err: invalid thread count: %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'x':
+      g_options.excludes[g_options.excludes_count++] = optarg;
+      break;
+    case 'L':
+      g_options.follow_symlinks = 1;
+      break;
+    case 's':
+      g_options.stats = 1;
+      break;
+    case 'i':
+      g_options.index_path = optarg;
+      break;
+    case 'f':
+      if (!output_parse_format(optarg, &g_options.format)) {
+        fprintf(stderr, "err: unknown output format: %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'q':
+      g_options.queries[g_options.queries_count++] = optarg;
+      break;
+    case OPTION_SORTED:
+      g_options.sorted = 1;
+      break;
+    case OPTION_MAX_SIZE:
+      if (!parse_size(optarg, &g_options.max_size)) {
+        fprintf(stderr, "err: invalid size: %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPTION_TIMEOUT:
+      if (!parse_timeout(optarg, &g_options.timeout_ms)) {
+        fprintf(stderr, "err: invalid timeout: %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case OPTION_WATCH:
+      g_options.watch_path = optarg;
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      exit(0);
+    default:
+      print_usage(argv[0]);
+      exit(1);
+    }
   }
-  pthread_mutex_init(&files.lock, NULL);
 
-  pthread_t threads[NUM_THREADS];
-  int err = 0;
-  for (int i = 0; i < NUM_THREADS; i++) {
-    err = pthread_create(&threads[i], NULL, process_files_async, &files);
-    if (err) {
+  static WatchHooks watch_hooks = { watch_parse, watch_accept, 0 };
+  if (g_options.watch_path != NULL) {
+    watch_hooks.follow_symlinks = g_options.follow_symlinks;
+    // results are served by name or path, not printed in order
+    g_options.sorted = 0;
+    if (!watch_init(&watch_hooks)) {
+      fprintf(stderr, "err: could not watch for changes\n");
       exit(1);
     }
   }
 
-  while (dirs_count > 0) {
-    char *path = dirs[--dirs_count];
+  arena_install();
 
-    DIR *dir = opendir(path);
-    if (dir == NULL) {
-      fprintf(stderr, "err: could not open directory: %s\n", path);
-      continue;
-    }
+  load_queries();
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-        continue;
-      }
+  if (g_options.index_path != NULL && !index_load(&g_index, g_options.index_path, g_queries_hash)) {
+    fprintf(stderr, "err: ignoring invalid index: %s\n", g_options.index_path);
+  }
 
-      size_t fullPathLength = strlen(entry->d_name) + strlen(path) + 2;
-      char *fullPath = calloc(1, fullPathLength);
-      if (fullPath == NULL) {
-        fprintf(stderr, "err: could not allocate memory for file path\n");
-        exit(1);
-      }
+  double start_time = now_seconds();
+
+  Pipeline pipeline;
+  pipeline.dirs.count = 0;
+  pipeline.dirs.outstanding = 0;
+  pipeline.dirs.size = 192;
+  pipeline.dirs.data = calloc(1, pipeline.dirs.size * sizeof(PathTask *));
+  if (pipeline.dirs.data == NULL) {
+    exit(1);
+  }
+  pthread_mutex_init(&pipeline.dirs.lock, NULL);
+  pthread_cond_init(&pipeline.dirs.cond, NULL);
 
-      sprintf(fullPath, "%s/%s", path, entry->d_name);
+  pipeline.visited.count = 0;
+  pipeline.visited.size = 256;
+  pipeline.visited.data = calloc(pipeline.visited.size, sizeof(DirId));
+  if (pipeline.visited.data == NULL) {
+    exit(1);
+  }
+  pthread_mutex_init(&pipeline.visited.lock, NULL);
 
-      if (entry->d_type == DT_DIR) {
-        if (dirs_count + 1 > dirs_size) {
-          dirs_size *= 2;
-          dirs = realloc(dirs, dirs_size * sizeof(char *));
-          if (dirs == NULL) {
-            fprintf(stderr, "err: could not allocate memory for directories\n");
-            exit(1);
-          }
-        }
-        dirs[dirs_count++] = fullPath;
+  char *default_root = ".";
+  char **roots = optind < argc ? &argv[optind] : &default_root;
+  int32_t roots_count = optind < argc ? argc - optind : 1;
+  if (g_options.watch_path == NULL) {
+    output_start(g_options.format, g_options.sorted, roots_count);
+  }
+  else {
+    output_set_format(g_options.format);
+  }
+
+  PathTask **file_roots = calloc(roots_count, sizeof(PathTask *));
+  int32_t file_roots_count = 0;
+  if (file_roots == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < roots_count; i++) {
+    OrderNode *order = g_options.sorted ? &order_root()->children[i] : NULL;
+    // watched paths are absolute so events and requests name files the same way
+    char resolved[PATH_MAX];
+    if (g_options.watch_path != NULL && realpath(roots[i], resolved) == NULL) {
+      fprintf(stderr, "err: could not resolve path: %s\n", roots[i]);
+      exit(1);
+    }
+    const char *path = g_options.watch_path != NULL ? resolved : roots[i];
+
+    // a file root is queued as it is, --max-size aside since it was asked for
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+      const char *name = strrchr(path, '/');
+      Grammar *grammar = grammar_for_file(name != NULL ? name + 1 : path);
+      if (grammar == NULL) {
+        fprintf(stderr, "err: no grammar for file: %s\n", path);
       }
-      else {
-        char *ext = strrchr(fullPath, '.');
-        if (ext != NULL && strcmp(ext, ".c") == 0) {
-          FILE *f = fopen(fullPath, "r");
-          if (f != NULL) {
-            fseek(f, 0, SEEK_END);
-            long file_length = ftell(f);
-            rewind(f);
-
-            size_t file_size = (file_length * sizeof(char)) + 1;
-            char *contents = calloc(1, file_size);
-            if (contents != NULL) {
-              fread(contents, file_size, 1, f);
-              push_file(&files, contents);
-              free(fullPath);
-            }
-            else {
-              fprintf(stderr, "err: could not allocate memory to read the file %s\n", path);
-            }
-            fclose(f);
-          }
-          else {
-            fprintf(stderr, "err: could not open file: %s\n", path);
-          }
+      // in path order a file root is a directory holding just the file
+      int32_t is_file = 0;
+      OrderNode *file_order = order != NULL ? order_children(order, &is_file, grammar != NULL) : NULL;
+      if (grammar != NULL) {
+        PathTask *file = path_task_new(NULL, path, file_order, grammar);
+        file->has_stat = 1;
+        file->size = st.st_size;
+        file->mtime_sec = st.st_mtim.tv_sec;
+        file->mtime_nsec = st.st_mtim.tv_nsec;
+        file_roots[file_roots_count++] = file;
+        if (g_options.watch_path != NULL) {
+          watch_add_root(path, 0);
         }
       }
+      if (order != NULL) {
+        order_publish(order);
+      }
+      continue;
+    }
+
+    PathTask *root = path_task_new(NULL, path, order, NULL);
+    size_t root_length = strlen(root->path);
+    while (root_length > 1 && root->path[root_length - 1] == '/') {
+      root->path[--root_length] = '\0';
+    }
+    if (g_options.watch_path != NULL) {
+      watch_add_root(root->path, 1);
+    }
+    push_dir(&pipeline.dirs, root);
+  }
+
+  int32_t jobs = g_options.jobs;
+  scheduler_init(&pipeline.scheduler, jobs, QUEUE_CAPACITY);
+
+  pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+  pthread_t *walker_threads = calloc(jobs, sizeof(pthread_t));
+  Walker *walkers = calloc(jobs, sizeof(Walker));
+  Worker *workers = calloc(jobs, sizeof(Worker));
+  if (threads == NULL || walker_threads == NULL || walkers == NULL || workers == NULL) {
+    exit(1);
+  }
+
+  int err = 0;
+  for (int i = 0; i < jobs; i++) {
+    workers[i].scheduler = &pipeline.scheduler;
+    workers[i].id = i;
+    err = pthread_create(&threads[i], NULL, process_files_async, &workers[i]);
+    if (err) {
+      exit(1);
     }
+  }
+
+  for (int i = 0; i < jobs; i++) {
+    walkers[i].pipeline = &pipeline;
+    err = pthread_create(&walker_threads[i], NULL, walk_dirs_async, &walkers[i]);
+    if (err) {
+      exit(1);
+    }
+  }
+
+  // pushed once the workers run, as they may fill the queue
+  for (int i = 0; i < file_roots_count; i++) {
+    scheduler_push(&pipeline.scheduler, file_roots[i]);
+  }
+  free(file_roots);
 
-    closedir(dir);
-    free(path);
+  for (int i = 0; i < jobs; i++) {
+    err = pthread_join(walker_threads[i], NULL);
+    if (err) {
+      fprintf(stderr, "err: failed joining thread\n");
+    }
   }
 
   // wait for all files to be processed
-  while (files.count > 0);
-  g_running = 0;
+  scheduler_close(&pipeline.scheduler);
+  scheduler_wait(&pipeline.scheduler);
 
-  for (int i = 0; i < NUM_THREADS; i++) {
+  for (int i = 0; i < jobs; i++) {
     err = pthread_join(threads[i], NULL);
     if (err) {
       fprintf(stderr, "err: failed joining thread\n");
     }
   }
 
-  ts_query_delete(g_query);
+  if (g_options.watch_path == NULL) {
+    output_finish();
+  }
+  for (int i = 0; i < jobs; i++) {
+    output_local_destroy(&workers[i].output);
+  }
+
+  if (g_options.stats) {
+    print_stats(workers, walkers, jobs, now_seconds() - start_time);
+  }
+
+  if (g_options.watch_path != NULL) {
+    for (int i = 0; i < jobs; i++) {
+      for (int j = 0; j < workers[i].records_count; j++) {
+        IndexRecord *r = &workers[i].records[j];
+        watch_add_file(r->path, r->size, r->mtime_sec, r->mtime_nsec, r->functions, r->functions_length);
+      }
+    }
+  }
+  if (g_options.index_path != NULL) {
+    write_index(workers, jobs);
+  }
+  free_records(workers, jobs);
+  index_close(&g_index);
+
+  int32_t watch_failed = 0;
+  if (g_options.watch_path != NULL) {
+    g_watch_worker.parser = ts_parser_new();
+    g_watch_worker.cursor = ts_query_cursor_new();
+    ts_parser_set_timeout_micros(g_watch_worker.parser, g_options.timeout_ms * 1000);
+    watch_failed = !watch_run(g_options.watch_path, g_options.stats);
+    ts_query_cursor_delete(g_watch_worker.cursor);
+    ts_parser_delete(g_watch_worker.parser);
+  }
+
+  free(threads);
+  free(walker_threads);
+  free(walkers);
+  free(workers);
+  free(pipeline.dirs.data);
+  free(pipeline.visited.data);
+  free(g_options.excludes);
+  free(g_options.queries);
+  scheduler_destroy(&pipeline.scheduler);
+  for (int i = 0; i < GRAMMARS_COUNT; i++) {
+    free_predicates(&g_grammars[i]);
+    ts_query_delete(g_grammars[i].query);
+    free(g_grammars[i].roles);
+  }
+  return watch_failed;
 }
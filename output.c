@@ -0,0 +1,656 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "output.h"
+
+#define OUTPUT_IOV_MAX 512
+#define OUTPUT_BINARY_VERSION 2
+
+typedef struct {
+  OrderNode *dir;
+  int32_t next;
+} OrderFrame;
+
+typedef struct {
+  OutputFormat format;
+  int32_t sorted;
+  pthread_t thread;
+  // batches submitted by workers, newest first
+  _Atomic(OutputBatch *) incoming;
+  atomic_int order_changed;
+  atomic_int sleeping;
+  atomic_int closed;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  OrderNode *root;
+  OrderFrame *frames;
+  int32_t frames_count;
+  int32_t frames_size;
+  struct iovec iov[OUTPUT_IOV_MAX];
+  OutputBatch *iov_batches[OUTPUT_IOV_MAX];
+  int32_t iov_count;
+  OutputStats stats;
+} Writer;
+
+static Writer g_writer;
+
+int32_t
+output_parse_format(const char *name, OutputFormat *format)
+{
+  if (strcmp(name, "text") == 0) {
+    *format = OUTPUT_TEXT;
+  }
+  else if (strcmp(name, "loc") == 0) {
+    *format = OUTPUT_LOCATION;
+  }
+  else if (strcmp(name, "jsonl") == 0) {
+    *format = OUTPUT_JSONL;
+  }
+  else if (strcmp(name, "binary") == 0) {
+    *format = OUTPUT_BINARY;
+  }
+  else {
+    return 0;
+  }
+
+  return 1;
+}
+
+static double
+output_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+write_all(const struct iovec *iov, int32_t count)
+{
+  struct iovec local[OUTPUT_IOV_MAX];
+  memcpy(local, iov, count * sizeof(struct iovec));
+  struct iovec *cur = local;
+
+  while (count > 0) {
+    ssize_t n = writev(STDOUT_FILENO, cur, count);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // nobody is reading anymore, drop the rest like printf would
+      return;
+    }
+    while (count > 0 && (size_t)n >= cur->iov_len) {
+      n -= cur->iov_len;
+      cur++;
+      count--;
+    }
+    if (count > 0) {
+      cur->iov_base = (char *)cur->iov_base + n;
+      cur->iov_len -= n;
+    }
+  }
+}
+
+static void
+batch_release(OutputBatch *batch)
+{
+  OutputLocal *owner = batch->owner;
+  batch->next = atomic_load(&owner->returned);
+  while (!atomic_compare_exchange_weak(&owner->returned, &batch->next, batch)) {
+  }
+}
+
+static void
+writer_flush(Writer *w)
+{
+  if (w->iov_count == 0) {
+    return;
+  }
+
+  double start = output_now();
+  write_all(w->iov, w->iov_count);
+  w->stats.write_seconds += output_now() - start;
+  for (int i = 0; i < w->iov_count; i++) {
+    w->stats.bytes += w->iov[i].iov_len;
+    batch_release(w->iov_batches[i]);
+  }
+  w->iov_count = 0;
+}
+
+static void
+writer_emit(Writer *w, OutputBatch *batch)
+{
+  if (batch->length == 0) {
+    batch_release(batch);
+    return;
+  }
+
+  if (w->iov_count == OUTPUT_IOV_MAX) {
+    writer_flush(w);
+  }
+  w->iov[w->iov_count] = (struct iovec){ batch->data, batch->length };
+  w->iov_batches[w->iov_count] = batch;
+  w->iov_count++;
+}
+
+static void
+writer_push_frame(Writer *w, OrderNode *dir)
+{
+  if (w->frames_count + 1 > w->frames_size) {
+    w->frames_size = w->frames_size > 0 ? w->frames_size * 2 : 64;
+    w->frames = realloc(w->frames, w->frames_size * sizeof(OrderFrame));
+    if (w->frames == NULL) {
+      fprintf(stderr, "err: could not allocate memory for output\n");
+      exit(1);
+    }
+  }
+  w->frames[w->frames_count++] = (OrderFrame){ dir, 0 };
+}
+
+// Emits every file whose predecessors in path order are all done.
+static void
+writer_advance(Writer *w)
+{
+  while (w->frames_count > 0) {
+    OrderFrame *frame = &w->frames[w->frames_count - 1];
+    OrderNode *dir = frame->dir;
+    if (!atomic_load_explicit(&dir->ready, memory_order_acquire)) {
+      return;
+    }
+
+    if (frame->next == dir->count) {
+      free(dir->children);
+      dir->children = NULL;
+      w->frames_count--;
+      continue;
+    }
+
+    OrderNode *child = &dir->children[frame->next];
+    if (child->is_dir) {
+      frame->next++;
+      writer_push_frame(w, child);
+    }
+    else if (child->batch != NULL) {
+      frame->next++;
+      writer_emit(w, child->batch);
+    }
+    else {
+      return;
+    }
+  }
+}
+
+static void
+writer_take(Writer *w, OutputBatch *list)
+{
+  // the list is newest first, reverse it so unsorted output keeps arrival order
+  OutputBatch *fifo = NULL;
+  while (list != NULL) {
+    OutputBatch *next = list->next;
+    list->next = fifo;
+    fifo = list;
+    list = next;
+  }
+
+  while (fifo != NULL) {
+    OutputBatch *next = fifo->next;
+    if (w->sorted) {
+      fifo->order->batch = fifo;
+    }
+    else {
+      writer_emit(w, fifo);
+    }
+    fifo = next;
+  }
+}
+
+static void *
+writer_run(void *arg)
+{
+  Writer *w = (Writer *)arg;
+
+  if (w->format == OUTPUT_BINARY) {
+    char header[8] = "LSFB";
+    uint32_t version = OUTPUT_BINARY_VERSION;
+    memcpy(header + 4, &version, sizeof(version));
+    struct iovec iov = { header, sizeof(header) };
+    write_all(&iov, 1);
+  }
+
+  for (;;) {
+    int32_t closed = atomic_load(&w->closed);
+    atomic_store(&w->order_changed, 0);
+    OutputBatch *list = atomic_exchange(&w->incoming, NULL);
+
+    writer_take(w, list);
+    if (w->sorted) {
+      writer_advance(w);
+    }
+    writer_flush(w);
+
+    if (closed && list == NULL) {
+      break;
+    }
+    if (list != NULL) {
+      continue;
+    }
+
+    double idle_start = output_now();
+    pthread_mutex_lock(&w->lock);
+    atomic_store(&w->sleeping, 1);
+    while (atomic_load(&w->incoming) == NULL && !atomic_load(&w->order_changed) && !atomic_load(&w->closed)) {
+      pthread_cond_wait(&w->wake, &w->lock);
+    }
+    atomic_store(&w->sleeping, 0);
+    pthread_mutex_unlock(&w->lock);
+    w->stats.idle_seconds += output_now() - idle_start;
+  }
+
+  return NULL;
+}
+
+static void
+writer_wake(Writer *w)
+{
+  if (atomic_load(&w->sleeping)) {
+    pthread_mutex_lock(&w->lock);
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+static void
+order_create_root(Writer *w, int32_t count)
+{
+  w->root = calloc(1, sizeof(OrderNode));
+  if (w->root == NULL) {
+    exit(1);
+  }
+  w->root->is_dir = 1;
+
+  int32_t *is_dir = calloc(count > 0 ? count : 1, sizeof(int32_t));
+  if (is_dir == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < count; i++) {
+    is_dir[i] = 1;
+  }
+  order_children(w->root, is_dir, count);
+  free(is_dir);
+
+  writer_push_frame(w, w->root);
+  atomic_store(&w->root->ready, 1);
+}
+
+void
+output_start(OutputFormat format, int32_t sorted, int32_t roots)
+{
+  Writer *w = &g_writer;
+  w->format = format;
+  w->sorted = sorted;
+  atomic_init(&w->incoming, NULL);
+  atomic_init(&w->order_changed, 0);
+  atomic_init(&w->sleeping, 0);
+  atomic_init(&w->closed, 0);
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->wake, NULL);
+  if (sorted) {
+    order_create_root(w, roots);
+  }
+
+  if (pthread_create(&w->thread, NULL, writer_run, w)) {
+    exit(1);
+  }
+}
+
+void
+output_set_format(OutputFormat format)
+{
+  g_writer.format = format;
+}
+
+void
+output_finish(void)
+{
+  Writer *w = &g_writer;
+  pthread_mutex_lock(&w->lock);
+  atomic_store(&w->closed, 1);
+  pthread_cond_signal(&w->wake);
+  pthread_mutex_unlock(&w->lock);
+
+  if (pthread_join(w->thread, NULL)) {
+    fprintf(stderr, "err: failed joining thread\n");
+  }
+
+  free(w->frames);
+  free(w->root);
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->wake);
+}
+
+void
+output_stats(OutputStats *stats)
+{
+  *stats = g_writer.stats;
+}
+
+static void
+free_batches(OutputBatch *batch)
+{
+  while (batch != NULL) {
+    OutputBatch *next = batch->next;
+    free(batch->data);
+    free(batch);
+    batch = next;
+  }
+}
+
+void
+output_local_destroy(OutputLocal *local)
+{
+  free_batches(local->spare);
+  free_batches(atomic_exchange(&local->returned, NULL));
+  local->spare = NULL;
+}
+
+OutputBatch *
+output_batch_begin(OutputLocal *local, OrderNode *order)
+{
+  if (local->spare == NULL) {
+    local->spare = atomic_exchange(&local->returned, NULL);
+  }
+
+  OutputBatch *batch = local->spare;
+  if (batch != NULL) {
+    local->spare = batch->next;
+  }
+  else {
+    batch = calloc(1, sizeof(OutputBatch));
+    if (batch == NULL) {
+      fprintf(stderr, "err: could not allocate memory for output\n");
+      exit(1);
+    }
+    batch->owner = local;
+  }
+
+  batch->next = NULL;
+  batch->order = order;
+  batch->length = 0;
+  return batch;
+}
+
+static void
+batch_reserve(OutputBatch *batch, size_t additional)
+{
+  if (batch->length + additional <= batch->size) {
+    return;
+  }
+
+  size_t size = batch->size > 0 ? batch->size : 4096;
+  while (size < batch->length + additional) {
+    size *= 2;
+  }
+  batch->data = realloc(batch->data, size);
+  if (batch->data == NULL) {
+    fprintf(stderr, "err: could not allocate memory for output\n");
+    exit(1);
+  }
+  batch->size = size;
+}
+
+static void
+batch_append(OutputBatch *batch, const void *data, size_t length)
+{
+  batch_reserve(batch, length);
+  memcpy(batch->data + batch->length, data, length);
+  batch->length += length;
+}
+
+static void
+batch_append_str(OutputBatch *batch, const char *str)
+{
+  batch_append(batch, str, strlen(str));
+}
+
+static void
+batch_append_uint(OutputBatch *batch, uint32_t value)
+{
+  char digits[10];
+  int n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+
+  batch_reserve(batch, n);
+  while (n > 0) {
+    batch->data[batch->length++] = digits[--n];
+  }
+}
+
+// Collapses runs of whitespace so multi-line declarators fit on one line.
+static void
+batch_append_oneline(OutputBatch *batch, const char *text, uint32_t length)
+{
+  batch_reserve(batch, length);
+  int32_t in_space = 0;
+  for (uint32_t i = 0; i < length; i++) {
+    char c = text[i];
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+      in_space = 1;
+      continue;
+    }
+    if (in_space && batch->length > 0 && batch->data[batch->length - 1] != ' ') {
+      batch->data[batch->length++] = ' ';
+    }
+    in_space = 0;
+    batch->data[batch->length++] = c;
+  }
+}
+
+static void
+batch_append_json_string(OutputBatch *batch, const char *text, size_t length)
+{
+  static const char hex[] = "0123456789abcdef";
+  // worst case every byte becomes \u00XX
+  batch_reserve(batch, length * 6 + 2);
+  char *out = batch->data + batch->length;
+  *out++ = '"';
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = text[i];
+    if (c == '"' || c == '\\') {
+      *out++ = '\\';
+      *out++ = c;
+    }
+    else if (c == '\n') {
+      *out++ = '\\';
+      *out++ = 'n';
+    }
+    else if (c == '\t') {
+      *out++ = '\\';
+      *out++ = 't';
+    }
+    else if (c == '\r') {
+      *out++ = '\\';
+      *out++ = 'r';
+    }
+    else if (c < 0x20) {
+      memcpy(out, "\\u00", 4);
+      out[4] = hex[c >> 4];
+      out[5] = hex[c & 0xf];
+      out += 6;
+    }
+    else {
+      *out++ = c;
+    }
+  }
+  *out++ = '"';
+  batch->length = out - batch->data;
+}
+
+static int32_t
+is_function_kind(const char *kind, uint32_t kind_length)
+{
+  return kind_length == 8 && memcmp(kind, "function", 8) == 0;
+}
+
+void
+output_function(OutputBatch *batch, const char *path,
+                uint32_t line, uint32_t column, uint32_t start_byte, uint32_t end_byte,
+                const char *kind, uint32_t kind_length,
+                const char *type, uint32_t type_length,
+                const char *declarator, uint32_t declarator_length)
+{
+  switch (g_writer.format) {
+  case OUTPUT_TEXT:
+    if (!is_function_kind(kind, kind_length)) {
+      batch_append_str(batch, "kind: ");
+      batch_append(batch, kind, kind_length);
+      batch_append_str(batch, "\n");
+    }
+    batch_append_str(batch, "type: ");
+    batch_append(batch, type, type_length);
+    batch_append_str(batch, "\ndeclarator: ");
+    batch_append(batch, declarator, declarator_length);
+    batch_append_str(batch, "\n\n");
+    break;
+  case OUTPUT_LOCATION:
+    batch_append_str(batch, path);
+    batch_append_str(batch, ":");
+    batch_append_uint(batch, line);
+    batch_append_str(batch, ":");
+    batch_append_uint(batch, column);
+    batch_append_str(batch, ": ");
+    if (!is_function_kind(kind, kind_length)) {
+      batch_append(batch, kind, kind_length);
+      batch_append_str(batch, ": ");
+    }
+    if (type_length > 0) {
+      batch_append_oneline(batch, type, type_length);
+      batch_append_str(batch, " ");
+    }
+    batch_append_oneline(batch, declarator, declarator_length);
+    batch_append_str(batch, "\n");
+    break;
+  case OUTPUT_JSONL:
+    batch_append_str(batch, "{\"path\":");
+    batch_append_json_string(batch, path, strlen(path));
+    batch_append_str(batch, ",\"line\":");
+    batch_append_uint(batch, line);
+    batch_append_str(batch, ",\"column\":");
+    batch_append_uint(batch, column);
+    batch_append_str(batch, ",\"kind\":");
+    batch_append_json_string(batch, kind, kind_length);
+    batch_append_str(batch, ",\"type\":");
+    batch_append_json_string(batch, type, type_length);
+    batch_append_str(batch, ",\"declarator\":");
+    batch_append_json_string(batch, declarator, declarator_length);
+    batch_append_str(batch, "}\n");
+    break;
+  case OUTPUT_BINARY: {
+    uint32_t path_length = strlen(path);
+    uint32_t fields[8] = {
+      line, column, start_byte, end_byte, path_length, kind_length, type_length, declarator_length
+    };
+    batch_append(batch, fields, sizeof(fields));
+    batch_append(batch, path, path_length);
+    batch_append(batch, kind, kind_length);
+    batch_append(batch, type, type_length);
+    batch_append(batch, declarator, declarator_length);
+    break;
+  }
+  }
+}
+
+void
+output_batch_append(OutputBatch *batch, OutputBatch *part)
+{
+  if (part->length > 0) {
+    batch_append(batch, part->data, part->length);
+  }
+  batch_release(part);
+}
+
+void
+output_batch_discard(OutputBatch *batch)
+{
+  batch_release(batch);
+}
+
+void
+output_batch_submit(OutputBatch *batch)
+{
+  Writer *w = &g_writer;
+
+  // unsorted output has no use for empty batches, keep them for the next file
+  if (!w->sorted && batch->length == 0) {
+    OutputLocal *local = batch->owner;
+    batch->next = local->spare;
+    local->spare = batch;
+    return;
+  }
+
+  batch->next = atomic_load(&w->incoming);
+  while (!atomic_compare_exchange_weak(&w->incoming, &batch->next, batch)) {
+  }
+  writer_wake(w);
+}
+
+OrderNode *
+order_root(void)
+{
+  return g_writer.root;
+}
+
+OrderNode *
+order_children(OrderNode *dir, const int32_t *is_dir, int32_t count)
+{
+  dir->count = count;
+  if (count == 0) {
+    return NULL;
+  }
+
+  dir->children = calloc(count, sizeof(OrderNode));
+  if (dir->children == NULL) {
+    fprintf(stderr, "err: could not allocate memory for output\n");
+    exit(1);
+  }
+  for (int i = 0; i < count; i++) {
+    dir->children[i].is_dir = is_dir[i];
+    atomic_init(&dir->children[i].ready, 0);
+  }
+
+  return dir->children;
+}
+
+void
+order_publish(OrderNode *dir)
+{
+  Writer *w = &g_writer;
+  atomic_store_explicit(&dir->ready, 1, memory_order_release);
+  atomic_store(&w->order_changed, 1);
+  writer_wake(w);
+}
+
+int
+order_compare_names(const char *a, int32_t a_is_dir, const char *b, int32_t b_is_dir)
+{
+  size_t i = 0;
+  while (a[i] != '\0' && a[i] == b[i]) {
+    i++;
+  }
+
+  unsigned char ca = a[i] != '\0' ? a[i] : a_is_dir ? '/' : '\0';
+  unsigned char cb = b[i] != '\0' ? b[i] : b_is_dir ? '/' : '\0';
+  if (ca != cb) {
+    return ca < cb ? -1 : 1;
+  }
+  // sibling names are unique, so this only happens when comparing an entry with itself
+  return 0;
+}
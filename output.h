@@ -0,0 +1,102 @@
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Every result has a kind, the name of the query capture that matched it.
+// The text formats leave it out for "function" so the default output is
+// unchanged.
+typedef enum {
+  OUTPUT_TEXT,
+  // path:line:col: [kind: ]type declarator
+  OUTPUT_LOCATION,
+  // one JSON object per result
+  OUTPUT_JSONL,
+  // "LSFB" + uint32 version, then per result: uint32 line, column,
+  // start_byte, end_byte, path_length, kind_length, type_length,
+  // declarator_length, followed by the four strings; host byte order
+  OUTPUT_BINARY,
+} OutputFormat;
+
+typedef struct OrderNode OrderNode;
+typedef struct OutputBatch OutputBatch;
+
+// Per-worker output state. Batches the writer is done with come back through
+// `returned` so steady-state output does not allocate.
+typedef struct {
+  _Atomic(OutputBatch *) returned;
+  OutputBatch *spare;
+} OutputLocal;
+
+// Everything one file produced, handed to the writer thread in one piece.
+struct OutputBatch {
+  OutputBatch *next;
+  OutputLocal *owner;
+  OrderNode *order;
+  char *data;
+  size_t length;
+  size_t size;
+};
+
+// A file or directory in --sorted mode. The writer emits files in a depth
+// first walk over these, and only waits where a directory has not been read
+// yet or a file has not been parsed yet, so output streams as soon as every
+// path before it is done.
+struct OrderNode {
+  OrderNode *children;
+  int32_t count;
+  int32_t is_dir;
+  atomic_int ready;
+  // only touched by the writer thread
+  OutputBatch *batch;
+};
+
+// Where the writer thread's time went.
+typedef struct {
+  double write_seconds;
+  double idle_seconds;
+  uint64_t bytes;
+} OutputStats;
+
+int32_t output_parse_format(const char *name, OutputFormat *format);
+
+// With `sorted`, output follows path order over `roots` root paths.
+void output_start(OutputFormat format, int32_t sorted, int32_t roots);
+// Call once every batch has been submitted; returns after everything is written.
+void output_finish(void);
+
+// For callers that format batches without starting the writer (--watch).
+void output_set_format(OutputFormat format);
+
+// Valid once output_finish has returned.
+void output_stats(OutputStats *stats);
+
+void output_local_destroy(OutputLocal *local);
+
+OutputBatch *output_batch_begin(OutputLocal *local, OrderNode *order);
+void output_function(OutputBatch *batch, const char *path,
+                     uint32_t line, uint32_t column, uint32_t start_byte, uint32_t end_byte,
+                     const char *kind, uint32_t kind_length,
+                     const char *type, uint32_t type_length,
+                     const char *declarator, uint32_t declarator_length);
+// Appends the output in `part`, which goes back to its owner.
+void output_batch_append(OutputBatch *batch, OutputBatch *part);
+void output_batch_submit(OutputBatch *batch);
+// Gives back a batch that will not be submitted.
+void output_batch_discard(OutputBatch *batch);
+
+// --sorted only: the root's children are the root paths, in argument order.
+OrderNode *order_root(void);
+// Allocates the children of `dir`; callers pass them already sorted with
+// order_compare_names.
+OrderNode *order_children(OrderNode *dir, const int32_t *is_dir, int32_t count);
+// Marks the children of `dir` as complete; `dir` must not be touched afterwards.
+void order_publish(OrderNode *dir);
+
+// Orders directory entries so a depth first walk yields full paths in
+// byte order: a directory sorts as if its name ended in '/'.
+int order_compare_names(const char *a, int32_t a_is_dir, const char *b, int32_t b_is_dir);
+
+#endif  // OUTPUT_H_
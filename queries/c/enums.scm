@@ -0,0 +1,4 @@
+; Enum definitions.
+(enum_specifier
+  name: (type_identifier) @name
+  body: (enumerator_list)) @enum
@@ -0,0 +1,2 @@
+; Function definitions, reported with their return type and declarator.
+(function_definition) @function
@@ -0,0 +1,6 @@
+; Object-like and function-like macros.
+(preproc_def
+  name: (identifier) @name) @macro
+
+(preproc_function_def
+  name: (identifier) @name) @macro
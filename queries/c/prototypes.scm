@@ -0,0 +1,10 @@
+; Function declarations without a body. Requiring an identifier inside the
+; function_declarator skips variables that hold function pointers.
+(declaration
+  declarator: (function_declarator
+    declarator: (identifier))) @prototype
+
+(declaration
+  declarator: (pointer_declarator
+    declarator: (function_declarator
+      declarator: (identifier)))) @prototype
@@ -0,0 +1,8 @@
+; Struct and union definitions; forward declarations have no body.
+(struct_specifier
+  name: (type_identifier) @name
+  body: (field_declaration_list)) @struct
+
+(union_specifier
+  name: (type_identifier) @name
+  body: (field_declaration_list)) @union
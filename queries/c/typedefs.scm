@@ -0,0 +1,2 @@
+; Typedefs, reported with the aliased type and the new name.
+(type_definition) @typedef
@@ -0,0 +1,1283 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "watch.h"
+#include "output.h"
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE)
+// source bytes of the changed files whose trees are kept for incremental reparsing
+#define WATCH_TREE_BUDGET (16 * 1024 * 1024)
+#define WATCH_MAX_CLIENTS 64
+#define WATCH_REQUEST_MAX 4096
+
+typedef struct WatchFile WatchFile;
+
+struct WatchFile {
+  char *path;
+  WatchFile *bucket_next;
+  // as of the last read, to skip unchanged files when rescanning
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  // the last rescan that found the file
+  uint32_t generation;
+  // results in the index blob format, kept for every file
+  IndexBuffer functions;
+  // only while the file is in the LRU
+  TSTree *tree;
+  char *text;
+  uint32_t text_length;
+  WatchFile *lru_prev;
+  WatchFile *lru_next;
+};
+
+// A result by name, for prefix requests.
+typedef struct {
+  const char *name;
+  uint32_t length;
+  WatchFile *file;
+  // of the IndexFunction in file->functions
+  uint32_t offset;
+} WatchName;
+
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+} WatchDirId;
+
+typedef struct {
+  char *path;
+  int32_t is_dir;
+} WatchRoot;
+
+typedef struct {
+  int fd;
+  uint32_t length;
+  char request[WATCH_REQUEST_MAX];
+} WatchClient;
+
+typedef struct {
+  const WatchHooks *hooks;
+  int inotify_fd;
+  int32_t stats;
+  // directory paths by watch descriptor; walkers add to it during the scan
+  pthread_mutex_t lock;
+  char **dirs;
+  // the last rescan that reached each directory
+  uint32_t *dir_generations;
+  // set on directories only watched for the file roots in them
+  int32_t *dir_files_only;
+  int32_t dirs_size;
+  int32_t dirs_count;
+  // directories reached by the current scan when following symlinks
+  WatchDirId *visited;
+  int32_t visited_count;
+  int32_t visited_size;
+  // rescanned when inotify drops events
+  WatchRoot *roots;
+  int32_t roots_count;
+  uint32_t generation;
+  // path -> file, chained
+  WatchFile **buckets;
+  uint32_t buckets_size;
+  uint32_t files_count;
+  // sorted by name once serving
+  WatchName *names;
+  int32_t names_count;
+  int32_t names_size;
+  WatchName *scratch;
+  int32_t scratch_size;
+  // most recently changed first
+  WatchFile *lru_head;
+  WatchFile *lru_tail;
+  size_t tree_bytes;
+  OutputLocal output;
+  WatchClient *clients;
+  int32_t clients_count;
+} Watcher;
+
+static Watcher g_watcher;
+static volatile sig_atomic_t g_stop;
+
+static void *
+watch_alloc(void *ptr, size_t size)
+{
+  ptr = realloc(ptr, size);
+  if (ptr == NULL) {
+    fprintf(stderr, "err: could not allocate memory for watch\n");
+    exit(1);
+  }
+
+  return ptr;
+}
+
+static double
+watch_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int32_t
+watch_init(const WatchHooks *hooks)
+{
+  Watcher *w = &g_watcher;
+  w->hooks = hooks;
+  w->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (w->inotify_fd < 0) {
+    return 0;
+  }
+  pthread_mutex_init(&w->lock, NULL);
+
+  w->buckets_size = 1024;
+  w->buckets = calloc(w->buckets_size, sizeof(WatchFile *));
+  w->clients = calloc(WATCH_MAX_CLIENTS, sizeof(WatchClient));
+  if (w->buckets == NULL || w->clients == NULL) {
+    exit(1);
+  }
+
+  return 1;
+}
+
+// A file root is followed through its directory, whose other entries are
+// ignored unless the directory is also watched in full.
+static void
+dir_watch(const char *path, int32_t files_only)
+{
+  Watcher *w = &g_watcher;
+  int wd = inotify_add_watch(w->inotify_fd, path, WATCH_EVENTS | IN_ONLYDIR);
+  if (wd < 0) {
+    fprintf(stderr, "err: could not watch directory: %s\n", path);
+    return;
+  }
+
+  char *copy = strdup(path);
+  if (copy == NULL) {
+    exit(1);
+  }
+
+  pthread_mutex_lock(&w->lock);
+  if (wd >= w->dirs_size) {
+    int32_t size = w->dirs_size > 0 ? w->dirs_size : 256;
+    while (wd >= size) {
+      size *= 2;
+    }
+    w->dirs = watch_alloc(w->dirs, size * sizeof(char *));
+    w->dir_generations = watch_alloc(w->dir_generations, size * sizeof(uint32_t));
+    w->dir_files_only = watch_alloc(w->dir_files_only, size * sizeof(int32_t));
+    memset(w->dirs + w->dirs_size, 0, (size - w->dirs_size) * sizeof(char *));
+    w->dirs_size = size;
+  }
+  // the same directory reached twice keeps its descriptor
+  if (w->dirs[wd] == NULL) {
+    w->dirs_count++;
+    w->dir_files_only[wd] = files_only;
+  }
+  else if (!files_only) {
+    w->dir_files_only[wd] = 0;
+  }
+  free(w->dirs[wd]);
+  w->dirs[wd] = copy;
+  w->dir_generations[wd] = w->generation;
+  pthread_mutex_unlock(&w->lock);
+}
+
+void
+watch_add_dir(const char *path)
+{
+  dir_watch(path, 0);
+}
+
+// Watches the directory holding the file root `path`.
+static void
+file_root_watch(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+  if (slash == NULL) {
+    return;
+  }
+  size_t length = slash > path ? (size_t)(slash - path) : 1;
+  char *dir = watch_alloc(NULL, length + 1);
+  memcpy(dir, path, length);
+  dir[length] = '\0';
+  dir_watch(dir, 1);
+  free(dir);
+}
+
+void
+watch_add_root(const char *path, int32_t is_dir)
+{
+  Watcher *w = &g_watcher;
+  w->roots = watch_alloc(w->roots, (w->roots_count + 1) * sizeof(WatchRoot));
+  w->roots[w->roots_count].path = strdup(path);
+  w->roots[w->roots_count].is_dir = is_dir;
+  if (w->roots[w->roots_count].path == NULL) {
+    exit(1);
+  }
+  w->roots_count++;
+  if (!is_dir) {
+    file_root_watch(path);
+  }
+}
+
+static int32_t
+is_file_root(const char *path)
+{
+  Watcher *w = &g_watcher;
+  for (int32_t i = 0; i < w->roots_count; i++) {
+    if (!w->roots[i].is_dir && strcmp(w->roots[i].path, path) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static WatchFile **
+files_slot(const char *path)
+{
+  Watcher *w = &g_watcher;
+  uint64_t hash = index_hash(path, strlen(path));
+  WatchFile **slot = &w->buckets[hash & (w->buckets_size - 1)];
+  while (*slot != NULL && strcmp((*slot)->path, path) != 0) {
+    slot = &(*slot)->bucket_next;
+  }
+
+  return slot;
+}
+
+static void
+files_grow(void)
+{
+  Watcher *w = &g_watcher;
+  uint32_t old_size = w->buckets_size;
+  WatchFile **old = w->buckets;
+  w->buckets_size *= 2;
+  w->buckets = calloc(w->buckets_size, sizeof(WatchFile *));
+  if (w->buckets == NULL) {
+    fprintf(stderr, "err: could not allocate memory for watch\n");
+    exit(1);
+  }
+
+  for (uint32_t i = 0; i < old_size; i++) {
+    WatchFile *file = old[i];
+    while (file != NULL) {
+      WatchFile *next = file->bucket_next;
+      WatchFile **slot = files_slot(file->path);
+      file->bucket_next = NULL;
+      *slot = file;
+      file = next;
+    }
+  }
+  free(old);
+}
+
+static WatchFile *
+files_insert(const char *path)
+{
+  Watcher *w = &g_watcher;
+  if (w->files_count + 1 > w->buckets_size) {
+    files_grow();
+  }
+
+  WatchFile *file = calloc(1, sizeof(WatchFile));
+  if (file == NULL || (file->path = strdup(path)) == NULL) {
+    fprintf(stderr, "err: could not allocate memory for watch\n");
+    exit(1);
+  }
+  file->generation = w->generation;
+  *files_slot(path) = file;
+  w->files_count++;
+
+  return file;
+}
+
+static int
+is_name_char(char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// The identifier a result goes by: its declarator without pointer stars,
+// parameters or array sizes.
+static void
+name_of(const char *declarator, uint32_t length, const char **name, uint32_t *name_length)
+{
+  uint32_t start = 0;
+  while (start < length && !is_name_char(declarator[start])) {
+    start++;
+  }
+  uint32_t end = start;
+  while (end < length && is_name_char(declarator[end])) {
+    end++;
+  }
+
+  *name = declarator + start;
+  *name_length = end - start;
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+  const WatchName *na = a;
+  const WatchName *nb = b;
+  int cmp = memcmp(na->name, nb->name, na->length < nb->length ? na->length : nb->length);
+  if (cmp != 0) {
+    return cmp;
+  }
+
+  return (na->length > nb->length) - (na->length < nb->length);
+}
+
+static void
+names_reserve(int32_t additional)
+{
+  Watcher *w = &g_watcher;
+  if (w->names_count + additional > w->names_size) {
+    while (w->names_count + additional > w->names_size) {
+      w->names_size = w->names_size > 0 ? w->names_size * 2 : 1024;
+    }
+    w->names = watch_alloc(w->names, w->names_size * sizeof(WatchName));
+  }
+}
+
+// Appends the names in `file` unsorted; returns how many.
+static int32_t
+names_append(WatchFile *file)
+{
+  Watcher *w = &g_watcher;
+  const char *start = file->functions.data;
+  const char *cursor = start;
+  const char *end = start + file->functions.length;
+  int32_t count = 0;
+  IndexFunction function;
+  const char *kind;
+  const char *type;
+  const char *declarator;
+  const char *at = cursor;
+  while (index_next_function(&cursor, end, &function, &kind, &type, &declarator)) {
+    names_reserve(1);
+    WatchName *name = &w->names[w->names_count++];
+    name_of(declarator, function.declarator_length, &name->name, &name->length);
+    name->file = file;
+    name->offset = at - start;
+    at = cursor;
+    count++;
+  }
+
+  return count;
+}
+
+// Adds the names in `file` to the sorted table with one merge.
+static void
+names_insert(WatchFile *file)
+{
+  Watcher *w = &g_watcher;
+  int32_t old_count = w->names_count;
+  int32_t added = names_append(file);
+  if (added == 0) {
+    return;
+  }
+
+  WatchName *fresh = &w->names[old_count];
+  qsort(fresh, added, sizeof(WatchName), compare_names);
+  if (w->names_count > w->scratch_size) {
+    w->scratch_size = w->names_size;
+    w->scratch = watch_alloc(w->scratch, w->scratch_size * sizeof(WatchName));
+  }
+
+  int32_t i = 0;
+  int32_t j = 0;
+  int32_t n = 0;
+  while (i < old_count || j < added) {
+    if (j == added || (i < old_count && compare_names(&w->names[i], &fresh[j]) <= 0)) {
+      w->scratch[n++] = w->names[i++];
+    }
+    else {
+      w->scratch[n++] = fresh[j++];
+    }
+  }
+
+  WatchName *names = w->names;
+  w->names = w->scratch;
+  w->scratch = names;
+  int32_t size = w->names_size;
+  w->names_size = w->scratch_size;
+  w->scratch_size = size;
+}
+
+static void
+names_remove(WatchFile *file)
+{
+  Watcher *w = &g_watcher;
+  int32_t n = 0;
+  for (int32_t i = 0; i < w->names_count; i++) {
+    if (w->names[i].file != file) {
+      w->names[n++] = w->names[i];
+    }
+  }
+  w->names_count = n;
+}
+
+void
+watch_add_file(const char *path, uint64_t size, int64_t mtime_sec, int64_t mtime_nsec,
+               const char *functions, uint32_t length)
+{
+  // reached from two roots, e.g. a file root inside a directory root
+  if (*files_slot(path) != NULL) {
+    return;
+  }
+
+  WatchFile *file = files_insert(path);
+  file->size = size;
+  file->mtime_sec = mtime_sec;
+  file->mtime_nsec = mtime_nsec;
+  if (length > 0) {
+    file->functions.data = watch_alloc(NULL, length);
+    memcpy(file->functions.data, functions, length);
+    file->functions.length = length;
+    file->functions.size = length;
+  }
+  // sorted all at once before serving
+  names_append(file);
+}
+
+static void
+lru_unlink(WatchFile *file)
+{
+  Watcher *w = &g_watcher;
+  if (file->tree == NULL) {
+    return;
+  }
+
+  if (file->lru_prev != NULL) {
+    file->lru_prev->lru_next = file->lru_next;
+  }
+  else {
+    w->lru_head = file->lru_next;
+  }
+  if (file->lru_next != NULL) {
+    file->lru_next->lru_prev = file->lru_prev;
+  }
+  else {
+    w->lru_tail = file->lru_prev;
+  }
+  file->lru_prev = NULL;
+  file->lru_next = NULL;
+}
+
+static void
+tree_drop(WatchFile *file)
+{
+  if (file->tree == NULL) {
+    return;
+  }
+
+  lru_unlink(file);
+  g_watcher.tree_bytes -= file->text_length;
+  ts_tree_delete(file->tree);
+  free(file->text);
+  file->tree = NULL;
+  file->text = NULL;
+  file->text_length = 0;
+}
+
+static void
+tree_keep(WatchFile *file, TSTree *tree, char *text, uint32_t length)
+{
+  Watcher *w = &g_watcher;
+  file->tree = tree;
+  file->text = text;
+  file->text_length = length;
+  file->lru_next = w->lru_head;
+  if (w->lru_head != NULL) {
+    w->lru_head->lru_prev = file;
+  }
+  w->lru_head = file;
+  if (w->lru_tail == NULL) {
+    w->lru_tail = file;
+  }
+  w->tree_bytes += length;
+
+  // the newest tree stays even if it alone is over budget
+  while (w->tree_bytes > WATCH_TREE_BUDGET && w->lru_tail != file) {
+    tree_drop(w->lru_tail);
+  }
+}
+
+static void
+file_remove(const char *path)
+{
+  Watcher *w = &g_watcher;
+  WatchFile **slot = files_slot(path);
+  WatchFile *file = *slot;
+  if (file == NULL) {
+    return;
+  }
+
+  *slot = file->bucket_next;
+  w->files_count--;
+  names_remove(file);
+  tree_drop(file);
+  free(file->functions.data);
+  free(file->path);
+  free(file);
+}
+
+// Removes every file under `path` and stops watching its directories.
+static void
+tree_remove(const char *path)
+{
+  Watcher *w = &g_watcher;
+  size_t length = strlen(path);
+  for (int32_t wd = 0; wd < w->dirs_size; wd++) {
+    char *dir = w->dirs[wd];
+    if (dir != NULL && strncmp(dir, path, length) == 0 && (dir[length] == '/' || dir[length] == '\0')) {
+      inotify_rm_watch(w->inotify_fd, wd);
+      free(dir);
+      w->dirs[wd] = NULL;
+      w->dirs_count--;
+    }
+  }
+
+  for (uint32_t i = 0; i < w->buckets_size; i++) {
+    WatchFile *file = w->buckets[i];
+    while (file != NULL) {
+      WatchFile *next = file->bucket_next;
+      if (strncmp(file->path, path, length) == 0 && file->path[length] == '/') {
+        file_remove(file->path);
+      }
+      file = next;
+    }
+  }
+}
+
+static void
+file_set_stat(WatchFile *file, const struct stat *st)
+{
+  file->size = st->st_size;
+  file->mtime_sec = st->st_mtim.tv_sec;
+  file->mtime_nsec = st->st_mtim.tv_nsec;
+  file->generation = g_watcher.generation;
+}
+
+static int32_t
+file_unchanged(const WatchFile *file, const struct stat *st)
+{
+  return file->size == (uint64_t)st->st_size
+    && file->mtime_sec == st->st_mtim.tv_sec
+    && file->mtime_nsec == st->st_mtim.tv_nsec;
+}
+
+static char *
+read_file(const char *path, uint32_t *length, struct stat *st)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  if (fstat(fd, st) != 0 || !S_ISREG(st->st_mode) || (uint64_t)st->st_size >= UINT32_MAX) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = st->st_size + 1;
+  size_t used = 0;
+  char *text = watch_alloc(NULL, size);
+  for (;;) {
+    if (used == size) {
+      size *= 2;
+      text = watch_alloc(text, size);
+    }
+    ssize_t n = read(fd, text + used, size - used);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    used += n;
+  }
+  close(fd);
+
+  if (used >= UINT32_MAX) {
+    free(text);
+    return NULL;
+  }
+  *length = used;
+  return text;
+}
+
+static TSPoint
+point_at(const char *text, uint32_t offset)
+{
+  TSPoint point = { 0, 0 };
+  const char *line = text;
+  const char *end = text + offset;
+  const char *newline;
+  while ((newline = memchr(line, '\n', end - line)) != NULL) {
+    point.row++;
+    line = newline + 1;
+  }
+  point.column = end - line;
+
+  return point;
+}
+
+// Describes the change from `old_text` to `text` as one replaced range
+// between their common prefix and suffix.
+static TSInputEdit
+text_edit(const char *old_text, uint32_t old_length, const char *text, uint32_t length)
+{
+  uint32_t limit = old_length < length ? old_length : length;
+  uint32_t prefix = 0;
+  while (prefix < limit && old_text[prefix] == text[prefix]) {
+    prefix++;
+  }
+  uint32_t suffix = 0;
+  while (suffix < limit - prefix && old_text[old_length - 1 - suffix] == text[length - 1 - suffix]) {
+    suffix++;
+  }
+
+  TSInputEdit edit;
+  edit.start_byte = prefix;
+  edit.old_end_byte = old_length - suffix;
+  edit.new_end_byte = length - suffix;
+  edit.start_point = point_at(text, prefix);
+  edit.old_end_point = point_at(old_text, edit.old_end_byte);
+  edit.new_end_point = point_at(text, edit.new_end_byte);
+  return edit;
+}
+
+static void
+file_update(const char *path)
+{
+  Watcher *w = &g_watcher;
+  double start = watch_now();
+  uint32_t length;
+  struct stat st;
+  char *text = read_file(path, &length, &st);
+  if (text == NULL) {
+    file_remove(path);
+    return;
+  }
+
+  WatchFile *file = *files_slot(path);
+  TSTree *old_tree = NULL;
+  if (file != NULL && file->tree != NULL) {
+    if (file->text_length == length && memcmp(file->text, text, length) == 0) {
+      file_set_stat(file, &st);
+      free(text);
+      return;
+    }
+    TSInputEdit edit = text_edit(file->text, file->text_length, text, length);
+    ts_tree_edit(file->tree, &edit);
+    old_tree = file->tree;
+  }
+
+  IndexBuffer functions = { 0 };
+  TSTree *tree = w->hooks->parse(path, text, length, old_tree, &functions);
+  if (file != NULL) {
+    tree_drop(file);
+  }
+  if (tree == NULL) {
+    free(functions.data);
+    free(text);
+    file_remove(path);
+    return;
+  }
+
+  if (file == NULL) {
+    file = files_insert(path);
+  }
+  file_set_stat(file, &st);
+  names_remove(file);
+  free(file->functions.data);
+  file->functions = functions;
+  names_insert(file);
+  tree_keep(file, tree, text, length);
+
+  if (w->stats) {
+    fprintf(stderr, "updated %s in %.3fms%s\n", path, (watch_now() - start) * 1e3,
+            old_tree != NULL ? " (incremental)" : "");
+  }
+}
+
+// Resolves `name` in `dir_fd` the way the initial walk does: symlinks to
+// files are followed, symlinks to directories only with -L. Returns DT_DIR,
+// DT_REG, or DT_UNKNOWN for entries to skip.
+static unsigned char
+entry_type(int dir_fd, const char *name, unsigned char type)
+{
+  if (type != DT_UNKNOWN && type != DT_LNK) {
+    return type == DT_DIR || type == DT_REG ? type : DT_UNKNOWN;
+  }
+
+  struct stat st;
+  if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+    return DT_UNKNOWN;
+  }
+  if (S_ISLNK(st.st_mode)) {
+    if (fstatat(dir_fd, name, &st, 0) != 0) {
+      return DT_UNKNOWN;
+    }
+    if (S_ISDIR(st.st_mode) && !g_watcher.hooks->follow_symlinks) {
+      return DT_UNKNOWN;
+    }
+  }
+
+  return S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+}
+
+// Returns 1 if the directory was not reached before in this scan.
+static int32_t
+visited_add(dev_t dev, ino_t ino)
+{
+  Watcher *w = &g_watcher;
+  if (w->visited_count + 1 > w->visited_size / 2) {
+    int32_t size = w->visited_size > 0 ? w->visited_size * 2 : 256;
+    WatchDirId *visited = calloc(size, sizeof(WatchDirId));
+    if (visited == NULL) {
+      fprintf(stderr, "err: could not allocate memory for watch\n");
+      exit(1);
+    }
+    for (int32_t i = 0; i < w->visited_size; i++) {
+      if (w->visited[i].ino != 0) {
+        uint32_t j = index_hash((const char *)&w->visited[i], sizeof(WatchDirId)) & (size - 1);
+        while (visited[j].ino != 0) {
+          j = (j + 1) & (size - 1);
+        }
+        visited[j] = w->visited[i];
+      }
+    }
+    free(w->visited);
+    w->visited = visited;
+    w->visited_size = size;
+  }
+
+  WatchDirId id = { dev, ino };
+  uint32_t i = index_hash((const char *)&id, sizeof(id)) & (w->visited_size - 1);
+  while (w->visited[i].ino != 0) {
+    if (w->visited[i].dev == dev && w->visited[i].ino == ino) {
+      return 0;
+    }
+    i = (i + 1) & (w->visited_size - 1);
+  }
+  w->visited[i] = id;
+  w->visited_count++;
+  return 1;
+}
+
+// A rescan only reads files whose size or mtime changed.
+static void
+file_check(int dir_fd, const char *name, const char *path)
+{
+  WatchFile *file = *files_slot(path);
+  struct stat st;
+  if (file != NULL && fstatat(dir_fd, name, &st, 0) == 0 && file_unchanged(file, &st)) {
+    file->generation = g_watcher.generation;
+  }
+  else {
+    file_update(path);
+  }
+}
+
+static void
+dir_scan(const char *path)
+{
+  Watcher *w = &g_watcher;
+  int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    return;
+  }
+  // only following symlinks can reach a directory twice
+  struct stat st;
+  if (w->hooks->follow_symlinks && (fstat(dir_fd, &st) != 0 || !visited_add(st.st_dev, st.st_ino))) {
+    close(dir_fd);
+    return;
+  }
+
+  watch_add_dir(path);
+  DIR *dir = fdopendir(dir_fd);
+  if (dir == NULL) {
+    close(dir_fd);
+    return;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+
+    unsigned char type = entry_type(dir_fd, entry->d_name, entry->d_type);
+    if (type == DT_UNKNOWN) {
+      continue;
+    }
+    if (!w->hooks->accept(path, entry->d_name, type == DT_DIR)) {
+      continue;
+    }
+
+    size_t length = strlen(path) + strlen(entry->d_name) + 2;
+    char *child = watch_alloc(NULL, length);
+    snprintf(child, length, "%s/%s", path, entry->d_name);
+    if (type == DT_DIR) {
+      dir_scan(child);
+    }
+    else {
+      file_check(dir_fd, entry->d_name, child);
+    }
+    free(child);
+  }
+  closedir(dir);
+}
+
+// Starts a scan that may reach any directory again.
+static void
+visited_clear(void)
+{
+  Watcher *w = &g_watcher;
+  w->visited_count = 0;
+  if (w->visited != NULL) {
+    memset(w->visited, 0, w->visited_size * sizeof(WatchDirId));
+  }
+}
+
+// Changes were dropped when the inotify queue overflowed: walks the roots
+// again, rereads files that changed and forgets whatever was not found.
+static void
+rescan(void)
+{
+  Watcher *w = &g_watcher;
+  double start = watch_now();
+  w->generation++;
+  visited_clear();
+  for (int32_t i = 0; i < w->roots_count; i++) {
+    if (w->roots[i].is_dir) {
+      dir_scan(w->roots[i].path);
+    }
+    else {
+      file_root_watch(w->roots[i].path);
+      file_check(AT_FDCWD, w->roots[i].path, w->roots[i].path);
+    }
+  }
+
+  for (int32_t wd = 0; wd < w->dirs_size; wd++) {
+    if (w->dirs[wd] != NULL && w->dir_generations[wd] != w->generation) {
+      inotify_rm_watch(w->inotify_fd, wd);
+      free(w->dirs[wd]);
+      w->dirs[wd] = NULL;
+      w->dirs_count--;
+    }
+  }
+  for (uint32_t i = 0; i < w->buckets_size; i++) {
+    WatchFile *file = w->buckets[i];
+    while (file != NULL) {
+      WatchFile *next = file->bucket_next;
+      if (file->generation != w->generation) {
+        file_remove(file->path);
+      }
+      file = next;
+    }
+  }
+
+  fprintf(stderr, "rescanned %u files in %d directories in %.3fms\n",
+          w->files_count, w->dirs_count, (watch_now() - start) * 1e3);
+}
+
+static void
+read_events(void)
+{
+  Watcher *w = &g_watcher;
+  char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char path[PATH_MAX];
+  int32_t overflowed = 0;
+
+  for (;;) {
+    ssize_t n = read(w->inotify_fd, buffer, sizeof(buffer));
+    if (n <= 0) {
+      break;
+    }
+
+    for (char *p = buffer; p < buffer + n; ) {
+      struct inotify_event *event = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        overflowed = 1;
+        continue;
+      }
+      if (event->wd < 0 || event->wd >= w->dirs_size || w->dirs[event->wd] == NULL) {
+        continue;
+      }
+      const char *dir = w->dirs[event->wd];
+      if (event->mask & IN_IGNORED) {
+        free(w->dirs[event->wd]);
+        w->dirs[event->wd] = NULL;
+        w->dirs_count--;
+        continue;
+      }
+      if (event->len == 0) {
+        continue;
+      }
+
+      int32_t is_dir = (event->mask & IN_ISDIR) != 0;
+      snprintf(path, sizeof(path), "%s/%s", dir, event->name);
+      if (w->dir_files_only[event->wd] && !is_file_root(path)) {
+        continue;
+      }
+      if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        // a symlink to a directory is not IN_ISDIR, but -L may have followed it
+        if (is_dir || w->hooks->follow_symlinks) {
+          tree_remove(path);
+        }
+        if (!is_dir) {
+          file_remove(path);
+        }
+        continue;
+      }
+
+      // a new file is read once it is closed after writing, but a new
+      // symlink is never written, so it is resolved as the initial walk does
+      unsigned char type = is_dir ? DT_DIR : DT_REG;
+      int32_t written = (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) != 0;
+      struct stat st;
+      if (!is_dir && (event->mask & (IN_CREATE | IN_MOVED_TO))
+          && lstat(path, &st) == 0 && S_ISLNK(st.st_mode)) {
+        type = entry_type(AT_FDCWD, path, DT_LNK);
+        written = 1;
+      }
+      if (type == DT_UNKNOWN || !w->hooks->accept(dir, event->name, type == DT_DIR)) {
+        continue;
+      }
+      if (type == DT_DIR && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+        visited_clear();
+        dir_scan(path);
+      }
+      else if (type == DT_REG && written) {
+        file_update(path);
+      }
+    }
+  }
+
+  if (overflowed) {
+    fprintf(stderr, "err: inotify queue overflowed, rescanning for missed changes\n");
+    rescan();
+  }
+}
+
+// Emits the result at `offset` in the file's blob; returns the next offset.
+static uint32_t
+emit_function(OutputBatch *batch, WatchFile *file, uint32_t offset)
+{
+  const char *start = file->functions.data;
+  const char *cursor = start + offset;
+  const char *end = start + file->functions.length;
+  IndexFunction function;
+  const char *kind;
+  const char *type;
+  const char *declarator;
+  if (!index_next_function(&cursor, end, &function, &kind, &type, &declarator)) {
+    return file->functions.length;
+  }
+
+  output_function(batch, file->path, function.start_row + 1, function.start_column + 1,
+                  function.start_byte, function.end_byte, kind, function.kind_length,
+                  type, function.type_length, declarator, function.declarator_length);
+  return cursor - start;
+}
+
+// Returns 0 for an unknown request.
+static int32_t
+answer(OutputBatch *batch, const char *request)
+{
+  Watcher *w = &g_watcher;
+  if (strncmp(request, "file ", 5) == 0) {
+    WatchFile *file = *files_slot(request + 5);
+    uint32_t offset = 0;
+    while (file != NULL && offset < file->functions.length) {
+      offset = emit_function(batch, file, offset);
+    }
+    return 1;
+  }
+
+  if (strncmp(request, "prefix ", 7) == 0) {
+    WatchName key = { request + 7, strlen(request + 7), NULL, 0 };
+    int32_t lo = 0;
+    int32_t hi = w->names_count;
+    while (lo < hi) {
+      int32_t mid = lo + (hi - lo) / 2;
+      if (compare_names(&w->names[mid], &key) < 0) {
+        lo = mid + 1;
+      }
+      else {
+        hi = mid;
+      }
+    }
+    for (int32_t i = lo; i < w->names_count; i++) {
+      WatchName *name = &w->names[i];
+      if (name->length < key.length || memcmp(name->name, key.name, key.length) != 0) {
+        break;
+      }
+      emit_function(batch, name->file, name->offset);
+    }
+    return 1;
+  }
+
+  return 0;
+}
+
+static void
+send_all(int fd, const char *data, size_t length)
+{
+  while (length > 0) {
+    ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    data += n;
+    length -= n;
+  }
+}
+
+static void
+client_close(int32_t i)
+{
+  Watcher *w = &g_watcher;
+  close(w->clients[i].fd);
+  w->clients[i] = w->clients[--w->clients_count];
+}
+
+// Reads what the client sent; answers and closes once a full line is in, or
+// once the client stops sending.
+static void
+client_read(int32_t i)
+{
+  Watcher *w = &g_watcher;
+  WatchClient *client = &w->clients[i];
+  ssize_t n = read(client->fd, client->request + client->length, WATCH_REQUEST_MAX - 1 - client->length);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  // a half-closed connection still gets an answer to the line it sent
+  if (n < 0 || (n == 0 && client->length == 0)) {
+    client_close(i);
+    return;
+  }
+  client->length += n;
+  client->request[client->length] = '\0';
+
+  char *newline = strchr(client->request, '\n');
+  if (newline == NULL && n > 0 && client->length < WATCH_REQUEST_MAX - 1) {
+    return;
+  }
+  if (newline != NULL) {
+    *newline = '\0';
+  }
+  size_t length = strlen(client->request);
+  if (length > 0 && client->request[length - 1] == '\r') {
+    client->request[length - 1] = '\0';
+  }
+
+  // the answer is written with a deadline, so a client that stops reading
+  // holds up the daemon for a second at most
+  int flags = fcntl(client->fd, F_GETFL);
+  fcntl(client->fd, F_SETFL, flags & ~O_NONBLOCK);
+  struct timeval timeout = { 1, 0 };
+  setsockopt(client->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  OutputBatch *batch = output_batch_begin(&w->output, NULL);
+  if (answer(batch, client->request)) {
+    send_all(client->fd, batch->data, batch->length);
+  }
+  else {
+    static const char error[] = "err: unknown request, expected: file <path> | prefix <text>\n";
+    send_all(client->fd, error, sizeof(error) - 1);
+  }
+  output_batch_discard(batch);
+  client_close(i);
+}
+
+// `created` is the socket as bound, so shutdown only removes its own.
+static int
+listen_on(const char *socket_path, struct stat *created)
+{
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "err: socket path too long: %s\n", socket_path);
+    return -1;
+  }
+  strcpy(address.sun_path, socket_path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "err: could not create socket\n");
+    return -1;
+  }
+
+  int32_t bound = bind(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+  if (!bound && errno == EADDRINUSE) {
+    // a socket left behind by a daemon that is gone can be replaced
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int32_t alive = probe >= 0 && connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+    if (probe >= 0) {
+      close(probe);
+    }
+    if (alive) {
+      fprintf(stderr, "err: another daemon is listening on %s\n", socket_path);
+      close(fd);
+      return -1;
+    }
+    // only ever replace a socket, never a file a mistyped --watch names
+    struct stat st;
+    if (lstat(socket_path, &st) != 0 || !S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "err: not replacing %s, it exists and is not a socket\n", socket_path);
+      close(fd);
+      return -1;
+    }
+    unlink(socket_path);
+    bound = bind(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+  }
+  if (!bound || listen(fd, WATCH_MAX_CLIENTS) != 0 || lstat(socket_path, created) != 0) {
+    fprintf(stderr, "err: could not listen on %s\n", socket_path);
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static void
+on_signal(int sig)
+{
+  (void)sig;
+  g_stop = 1;
+}
+
+static void
+watch_destroy(void)
+{
+  Watcher *w = &g_watcher;
+  for (uint32_t i = 0; i < w->buckets_size; i++) {
+    WatchFile *file = w->buckets[i];
+    while (file != NULL) {
+      WatchFile *next = file->bucket_next;
+      tree_drop(file);
+      free(file->functions.data);
+      free(file->path);
+      free(file);
+      file = next;
+    }
+  }
+  for (int32_t i = 0; i < w->dirs_size; i++) {
+    free(w->dirs[i]);
+  }
+  for (int32_t i = 0; i < w->roots_count; i++) {
+    free(w->roots[i].path);
+  }
+  free(w->roots);
+  free(w->dir_generations);
+  free(w->dir_files_only);
+  free(w->visited);
+  output_local_destroy(&w->output);
+  free(w->buckets);
+  free(w->dirs);
+  free(w->names);
+  free(w->scratch);
+  free(w->clients);
+  close(w->inotify_fd);
+  pthread_mutex_destroy(&w->lock);
+}
+
+int32_t
+watch_run(const char *socket_path, int32_t stats)
+{
+  Watcher *w = &g_watcher;
+  w->stats = stats;
+  qsort(w->names, w->names_count, sizeof(WatchName), compare_names);
+
+  struct stat created;
+  int listen_fd = listen_on(socket_path, &created);
+  if (listen_fd < 0) {
+    watch_destroy();
+    return 0;
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_signal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  fprintf(stderr, "watching %u files in %d directories, listening on %s\n",
+          w->files_count, w->dirs_count, socket_path);
+
+  struct pollfd fds[2 + WATCH_MAX_CLIENTS];
+  while (!g_stop) {
+    fds[0] = (struct pollfd){ w->inotify_fd, POLLIN, 0 };
+    // stop accepting while every client slot is taken
+    fds[1] = (struct pollfd){ w->clients_count < WATCH_MAX_CLIENTS ? listen_fd : -1, POLLIN, 0 };
+    int32_t clients = w->clients_count;
+    for (int32_t i = 0; i < clients; i++) {
+      fds[2 + i] = (struct pollfd){ w->clients[i].fd, POLLIN, 0 };
+    }
+
+    if (poll(fds, 2 + clients, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    // closing a client moves the last one into its slot, so go backwards
+    for (int32_t i = clients - 1; i >= 0; i--) {
+      if (fds[2 + i].revents != 0) {
+        client_read(i);
+      }
+    }
+    if (fds[1].revents & POLLIN) {
+      int fd = accept(listen_fd, NULL, NULL);
+      if (fd >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        w->clients[w->clients_count++] = (WatchClient){ .fd = fd, .length = 0 };
+      }
+    }
+    if (fds[0].revents & POLLIN) {
+      read_events();
+    }
+  }
+
+  while (w->clients_count > 0) {
+    client_close(w->clients_count - 1);
+  }
+  close(listen_fd);
+  // unless something else has taken the path since
+  struct stat st;
+  if (lstat(socket_path, &st) == 0 && st.st_dev == created.st_dev && st.st_ino == created.st_ino) {
+    unlink(socket_path);
+  }
+  watch_destroy();
+  return 1;
+}
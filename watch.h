@@ -0,0 +1,46 @@
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include <stdint.h>
+#include "tree_sitter/api.h"
+#include "index.h"
+
+// --watch: after the initial scan every file's results stay in memory, and
+// inotify keeps them current while queries are answered on a Unix socket.
+// Trees are only kept for recently changed files, so saving the same file
+// again reparses it incrementally; an LRU over their source size bounds the
+// memory they take, and evicted files keep their results.
+//
+// Requests are one line per connection, answered in the --format in effect,
+// after which the connection is closed:
+//   file <path>      results in the file at <path>, as the daemon reports it
+//   prefix <text>    results whose name starts with <text>, by name
+
+typedef struct {
+  // Extracts the results in `text` into `functions`. `old_tree` is the file's
+  // previous tree, already edited to match `text`, or NULL. Returns the new
+  // tree, or NULL if the file is skipped.
+  TSTree *(*parse)(const char *path, const char *text, uint32_t length, TSTree *old_tree,
+                   IndexBuffer *functions);
+  // Whether `name` in `dir_path` is a file to extract from or a directory to watch.
+  int32_t (*accept)(const char *dir_path, const char *name, int32_t is_dir);
+  // as the initial walk: symlinks to files are always followed, symlinks to
+  // directories only when this is set
+  int32_t follow_symlinks;
+} WatchHooks;
+
+// Call before the initial scan; returns 0 if inotify is not available.
+int32_t watch_init(const WatchHooks *hooks);
+// Watches a directory; safe to call from several threads during the scan.
+void watch_add_dir(const char *path);
+// Adds a root path, scanned again if inotify drops events. A file root is
+// followed on its own, without the rest of its directory.
+void watch_add_root(const char *path, int32_t is_dir);
+// Adds a file's results from the initial scan, as of the given size and
+// mtime; `functions` is copied.
+void watch_add_file(const char *path, uint64_t size, int64_t mtime_sec, int64_t mtime_nsec,
+                    const char *functions, uint32_t length);
+// Serves `socket_path` until SIGINT or SIGTERM; returns 0 if it cannot listen.
+int32_t watch_run(const char *socket_path, int32_t stats);
+
+#endif  // WATCH_H_